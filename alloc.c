@@ -39,6 +39,7 @@ again:
     bh = fs_bread(bitmap_blk, &err);
     if (err)
         goto out;
+    set_buffer_meta(bh);
 
     if (ext4_free_blks_count(block_group)) {
         if (block_group == super_n_block_groups() - 1) {
@@ -128,6 +129,7 @@ void ext4_ext_free_blocks(struct inode *inode,
     bh = fs_bread(bitmap_blk, &err);
     if (err)
         goto out;
+    set_buffer_meta(bh);
 
     index = block - super_first_data_block() -
             block_group * super_blocks_per_group();
@@ -18,15 +18,24 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 
 #include "buffer.h"
 #include "logging.h"
 
-static int buffer_free_threshold = 90000;
-static int buffer_dirty_threshold = 9;
-static int buffer_dirty_count = 0;
-static int buffer_writeback_ms = 10000;
+/* How often the writeback thread looks for expired dirty buffers */
+#define WB_INTERVAL_MS 1000
+
+static unsigned long bdev_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
 
 /*
  * Pseduo device reading routine.
@@ -88,7 +97,55 @@ int pread_wrapper(int disk_fd, void *p, size_t size, off_t where)
 #endif
 }
 
-#ifndef USE_AIO
+/*
+ * Vectored variant of pread_wrapper().  Every iovec is expected to cover
+ * whole blocks, so no alignment fixups are needed.
+ */
+static ssize_t preadv_wrapper(int disk_fd, const struct iovec *iov,
+			      int iovcnt, off_t where)
+{
+#if defined(__APPLE__)
+	ssize_t ret = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		ssize_t pread_ret = pread(disk_fd, iov[i].iov_base,
+					  iov[i].iov_len, where + ret);
+		if (pread_ret < 0)
+			return pread_ret;
+		ret += pread_ret;
+		if ((size_t)pread_ret != iov[i].iov_len)
+			break;
+	}
+	return ret;
+#else
+	return preadv(disk_fd, iov, iovcnt, where);
+#endif
+}
+
+static ssize_t pwritev_wrapper(int disk_fd, const struct iovec *iov,
+			       int iovcnt, off_t where)
+{
+#if defined(__APPLE__)
+	ssize_t ret = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		ssize_t pwrite_ret = pwrite(disk_fd, iov[i].iov_base,
+					    iov[i].iov_len, where + ret);
+		if (pwrite_ret < 0)
+			return pwrite_ret;
+		ret += pwrite_ret;
+		if ((size_t)pwrite_ret != iov[i].iov_len)
+			break;
+	}
+	return ret;
+#else
+	return pwritev(disk_fd, iov, iovcnt, where);
+#endif
+}
+
+#ifdef USE_IO_THREAD
 
 static int pwrite_wrapper(int disk_fd, const void *p, size_t size, off_t where)
 {
@@ -175,79 +232,196 @@ static int device_write(int fd, uint64_t block, int count, int blk_size,
 
 #endif
 
-static struct buffer_head *__buffer_search(struct rb_root *root,
-					   uint64_t blocknr)
+/*
+ * The cache is indexed by a hash of the block number, split into
+ * BH_HASH_SHARDS independently locked shards.  Each shard is an open
+ * addressed table with linear probing, kept at most half full.
+ */
+#define BH_HASH_MIN_SIZE 64
+
+static inline uint64_t bh_hash(uint64_t blocknr)
 {
-	struct rb_node *new = root->rb_node;
+	uint64_t h = blocknr * 0x9E3779B97F4A7C15ULL;
+	return h ^ (h >> 29);
+}
 
-	/* Figure out where to put new node */
-	while (new) {
-		struct buffer_head *bh =
-		    container_of(new, struct buffer_head, b_rb_node);
-		int64_t result = blocknr - bh->b_blocknr;
+static inline struct bh_hash_shard *bh_hash_shard(struct block_device *bdev,
+						  uint64_t blocknr)
+{
+	return &bdev->bd_bh_hash[bh_hash(blocknr) >> (64 - BH_HASH_SHARD_BITS)];
+}
 
-		if (result < 0)
-			new = new->rb_left;
-		else if (result > 0)
-			new = new->rb_right;
-		else
+static struct buffer_head *__buffer_search(struct bh_hash_shard *shard,
+					   uint64_t blocknr)
+{
+	unsigned int mask = shard->bs_size - 1;
+	unsigned int i = bh_hash(blocknr) & mask;
+	struct buffer_head *bh;
+
+	while ((bh = shard->bs_slots[i])) {
+		if (bh->b_blocknr == blocknr)
 			return bh;
+		i = (i + 1) & mask;
 	}
 
 	return NULL;
 }
 
-static int buffer_blocknr_cmp(struct rb_node *a, struct rb_node *b)
+static void __buffer_hash_add(struct buffer_head **slots, unsigned int size,
+			      struct buffer_head *bh)
 {
-	struct buffer_head *a_bh, *b_bh;
-	a_bh = container_of(a, struct buffer_head, b_rb_node);
-	b_bh = container_of(b, struct buffer_head, b_rb_node);
+	unsigned int mask = size - 1;
+	unsigned int i = bh_hash(bh->b_blocknr) & mask;
 
-	if ((int64_t)(a_bh->b_blocknr - b_bh->b_blocknr) < 0)
-		return -1;
-	if ((int64_t)(a_bh->b_blocknr - b_bh->b_blocknr) > 0)
-		return 1;
+	while (slots[i])
+		i = (i + 1) & mask;
+	slots[i] = bh;
+}
+
+static int __buffer_hash_grow(struct bh_hash_shard *shard)
+{
+	unsigned int size = shard->bs_size * 2, i;
+	struct buffer_head **slots;
+
+	slots = calloc(size, sizeof(struct buffer_head *));
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < shard->bs_size; i++)
+		if (shard->bs_slots[i])
+			__buffer_hash_add(slots, size, shard->bs_slots[i]);
+
+	free(shard->bs_slots);
+	shard->bs_slots = slots;
+	shard->bs_size = size;
+	return 0;
+}
+
+/*
+ * Remove @bh from its shard, shifting back the entries that follow it
+ * in the probe sequence so that no tombstones are needed.
+ */
+static void __buffer_remove(struct bh_hash_shard *shard,
+			    struct buffer_head *bh)
+{
+	unsigned int mask = shard->bs_size - 1;
+	unsigned int i = bh_hash(bh->b_blocknr) & mask, j;
+
+	while (shard->bs_slots[i] != bh)
+		i = (i + 1) & mask;
+
+	for (j = (i + 1) & mask; shard->bs_slots[j]; j = (j + 1) & mask) {
+		unsigned int home = bh_hash(shard->bs_slots[j]->b_blocknr) & mask;
+
+		/* Move slot j into the hole at i unless its home lies
+		 * cyclically in (i, j]. */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			shard->bs_slots[i] = shard->bs_slots[j];
+			i = j;
+		}
+	}
+	shard->bs_slots[i] = NULL;
+	shard->bs_nr--;
+}
+
+static int buffer_hash_init(struct block_device *bdev)
+{
+	int i;
+
+	for (i = 0; i < BH_HASH_SHARDS; i++) {
+		struct bh_hash_shard *shard = &bdev->bd_bh_hash[i];
+
+		shard->bs_slots = calloc(BH_HASH_MIN_SIZE,
+					 sizeof(struct buffer_head *));
+		if (!shard->bs_slots)
+			return -ENOMEM;
+		shard->bs_size = BH_HASH_MIN_SIZE;
+		shard->bs_nr = 0;
+		pthread_mutex_init(&shard->bs_lock, NULL);
+	}
 	return 0;
 }
 
+/* Undo buffer_hash_init() of a cache that never held any buffer */
+static void buffer_hash_free(struct block_device *bdev)
+{
+	int i;
+
+	for (i = 0; i < BH_HASH_SHARDS; i++)
+		free(bdev->bd_bh_hash[i].bs_slots);
+}
+
+/*
+ * Look up @blocknr in the cache and take a reference on the buffer
+ * before the shard lock is dropped, so that a concurrent reclaim can
+ * not free it under us.
+ */
 static struct buffer_head *buffer_search(struct block_device *bdev,
 					 uint64_t blocknr)
 {
-	struct rb_root *root;
+	struct bh_hash_shard *shard = bh_hash_shard(bdev, blocknr);
 	struct buffer_head *bh;
-	root = &bdev->bd_bh_root;
-	pthread_mutex_lock(&bdev->bd_bh_root_lock);
-	bh = __buffer_search(root, blocknr);
-	pthread_mutex_unlock(&bdev->bd_bh_root_lock);
+
+	pthread_mutex_lock(&shard->bs_lock);
+	bh = __buffer_search(shard, blocknr);
+	if (bh)
+		get_bh(bh);
+	pthread_mutex_unlock(&shard->bs_lock);
 
 	return bh;
 }
 
-static void buffer_insert(struct block_device *bdev,
-			  struct buffer_head *bh)
+/*
+ * Insert @bh into the cache unless another thread has inserted a buffer
+ * for the same block in the meantime.  The buffer that ends up in the
+ * cache is returned with a reference held.
+ */
+static struct buffer_head *buffer_insert(struct block_device *bdev,
+					 struct buffer_head *bh)
 {
-	pthread_mutex_lock(&bdev->bd_bh_root_lock);
-	rb_insert(&bdev->bd_bh_root, &bh->b_rb_node, buffer_blocknr_cmp);
-	pthread_mutex_unlock(&bdev->bd_bh_root_lock);
-}
+	struct bh_hash_shard *shard = bh_hash_shard(bdev, bh->b_blocknr);
+	struct buffer_head *old_bh;
+
+	pthread_mutex_lock(&shard->bs_lock);
+	old_bh = __buffer_search(shard, bh->b_blocknr);
+	if (old_bh) {
+		get_bh(old_bh);
+		pthread_mutex_unlock(&shard->bs_lock);
+		return old_bh;
+	}
+	if ((shard->bs_nr + 1) * 2 > shard->bs_size &&
+	    __buffer_hash_grow(shard) < 0) {
+		pthread_mutex_unlock(&shard->bs_lock);
+		return NULL;
+	}
+	__buffer_hash_add(shard->bs_slots, shard->bs_size, bh);
+	shard->bs_nr++;
+	get_bh(bh);
+	pthread_mutex_unlock(&shard->bs_lock);
 
-static void __buffer_remove(struct block_device *bdev,
-			  struct buffer_head *bh)
-{
-	rb_erase(&bh->b_rb_node, &bdev->bd_bh_root);
+	return bh;
 }
 
 
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 static void *buffer_io_thread(void *arg);
 #endif
 
+#ifdef USE_IO_URING
+#define URING_ENTRIES 256
+static void *buffer_uring_reap_thread(void *arg);
+#endif
+
 static void *buffer_writeback_thread(void *arg);
+static void *buffer_wb_writer_thread(void *arg);
 
-struct block_device *bdev_alloc(int fd, int blocksize_bits)
+struct block_device *bdev_alloc(int fd, int blocksize_bits,
+				const struct bdev_config *config)
 {
+	const struct bh_policy *policy = config->policy;
 	struct block_device *bdev;
 	struct super_block *super;
+	int i;
 
 	bdev = malloc(sizeof(struct block_device) + sizeof(struct super_block));
 	memset(bdev, 0,
@@ -259,26 +433,79 @@ struct block_device *bdev_alloc(int fd, int blocksize_bits)
 	bdev->bd_super = super;
 
 	INIT_LIST_HEAD(&bdev->bd_bh_free);
+	INIT_LIST_HEAD(&bdev->bd_bh_pool);
+	INIT_LIST_HEAD(&bdev->bd_bh_chunks);
 	INIT_LIST_HEAD(&bdev->bd_bh_dirty);
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 	INIT_LIST_HEAD(&bdev->bd_bh_ioqueue);
 #endif
 	pthread_mutex_init(&bdev->bd_bh_free_lock, NULL);
+	pthread_mutex_init(&bdev->bd_bh_pool_lock, NULL);
+	pthread_cond_init(&bdev->bd_bh_free_wait, NULL);
 	pthread_mutex_init(&bdev->bd_bh_dirty_lock, NULL);
-#ifndef USE_AIO
+	pthread_cond_init(&bdev->bd_dirty_wait, NULL);
+#ifdef USE_IO_THREAD
 	pthread_mutex_init(&bdev->bd_bh_ioqueue_lock, NULL);
 #endif
-	pthread_mutex_init(&bdev->bd_bh_root_lock, NULL);
+	if (buffer_hash_init(bdev) < 0) {
+		ERR("Failed to allocate the buffer cache index");
+		buffer_hash_free(bdev);
+		free(bdev);
+		return NULL;
+	}
 
 	super->s_blocksize_bits = blocksize_bits;
 	super->s_blocksize = 1 << super->s_blocksize_bits;
 	super->s_bdev = bdev;
 
+	bdev->bd_max_buffers = config->cache_size >> blocksize_bits;
+	if (bdev->bd_max_buffers < BH_MIN_BUFFERS) {
+		WARNING("Cache size of %zu bytes is too small, using %d buffers",
+			config->cache_size, BH_MIN_BUFFERS);
+		bdev->bd_max_buffers = BH_MIN_BUFFERS;
+	}
+	bdev->bd_dirty_background =
+		bdev->bd_max_buffers * config->dirty_background_ratio / 100;
+	bdev->bd_dirty_limit = bdev->bd_max_buffers * config->dirty_ratio / 100;
+	bdev->bd_dirty_expire_ms = config->dirty_expire * 1000UL;
+	INFO("Buffer cache: %lu buffers of %zu bytes, %s policy, "
+	     "writeback above %lu dirty buffers, throttled above %lu",
+	     bdev->bd_max_buffers, super->s_blocksize, policy->name,
+	     bdev->bd_dirty_background, bdev->bd_dirty_limit);
+
+	bdev->bd_policy = policy;
+	if (policy->init(bdev, bdev->bd_max_buffers) < 0) {
+		ERR("Failed to set up the %s cache policy", policy->name);
+		buffer_hash_free(bdev);
+		free(bdev);
+		return NULL;
+	}
+
+#ifdef USE_IO_URING
+	if (uring_init(&bdev->bd_uring, URING_ENTRIES) < 0) {
+		ERR("Failed to set up io_uring");
+		policy->exit(bdev);
+		buffer_hash_free(bdev);
+		free(bdev);
+		return NULL;
+	}
+	pthread_create(&bdev->bd_uring_reap_thread, NULL,
+			buffer_uring_reap_thread, bdev);
+#endif
+
+	pthread_mutex_init(&bdev->bd_wb_lock, NULL);
+	pthread_cond_init(&bdev->bd_wb_work, NULL);
+	pthread_cond_init(&bdev->bd_wb_done, NULL);
+	INIT_LIST_HEAD(&bdev->bd_wb_runs);
+	for (i = 0; i < WB_NR_WRITERS; i++)
+		pthread_create(&bdev->bd_wb_writers[i], NULL,
+			       buffer_wb_writer_thread, bdev);
+
 	pipe(bdev->bd_bh_writeback_wakeup_fd);
 	pthread_create(&bdev->bd_bh_writeback_thread, NULL,
 			buffer_writeback_thread, bdev);
 
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 	pipe(bdev->bd_bh_io_wakeup_fd);
 	pthread_create(&bdev->bd_bh_io_thread, NULL,
 			buffer_io_thread, bdev);
@@ -288,9 +515,25 @@ struct block_device *bdev_alloc(int fd, int blocksize_bits)
 }
 
 
+/*
+ * Kick off background writeback.  Only one notification is kept
+ * pending, the writeback thread rearms it once it has picked it up.
+ */
 static void bdev_writeback_thread_notify(struct block_device *bdev)
 {
 	signed char test_byte = 1;
+
+	if (__sync_lock_test_and_set(&bdev->bd_wb_kicked, 1))
+		return;
+	write(bdev->bd_bh_writeback_wakeup_fd[1], &test_byte, sizeof(test_byte));
+}
+
+/*
+ * Ask for everything to be written back, regardless of the thresholds.
+ */
+static void bdev_writeback_thread_notify_sync(struct block_device *bdev)
+{
+	signed char test_byte = 2;
 	write(bdev->bd_bh_writeback_wakeup_fd[1], &test_byte, sizeof(test_byte));
 }
 
@@ -314,7 +557,12 @@ static int bdev_is_notify_exiting(signed char byte)
 	return 0;
 }
 
-#ifndef USE_AIO
+static int bdev_is_notify_sync(signed char byte)
+{
+	return byte == 2;
+}
+
+#ifdef USE_IO_THREAD
 
 static void bdev_io_thread_notify(struct block_device *bdev)
 {
@@ -338,37 +586,71 @@ static signed char bdev_io_thread_read_notify(struct block_device *bdev)
 #endif
 
 
-static int sync_dirty_buffer(struct buffer_head *bh);
 static void detach_bh_from_freelist(struct buffer_head *bh);
-static void buffer_free(struct buffer_head *bh);
+static void remove_buffer_from_writeback(struct buffer_head *bh);
+static void bh_chunks_free(struct block_device *bdev);
 
 void bdev_free(struct block_device *bdev)
 {
-	struct rb_node *node;
+	unsigned int i, j;
 
 	bdev_writeback_thread_notify_exit(bdev);
 	pthread_join(bdev->bd_bh_writeback_thread, NULL);
 
-#ifndef USE_AIO
+	pthread_mutex_lock(&bdev->bd_wb_lock);
+	bdev->bd_wb_exiting = 1;
+	pthread_cond_broadcast(&bdev->bd_wb_work);
+	pthread_mutex_unlock(&bdev->bd_wb_lock);
+	for (i = 0; i < WB_NR_WRITERS; i++)
+		pthread_join(bdev->bd_wb_writers[i], NULL);
+	pthread_mutex_destroy(&bdev->bd_wb_lock);
+	pthread_cond_destroy(&bdev->bd_wb_work);
+	pthread_cond_destroy(&bdev->bd_wb_done);
+
+#ifdef USE_IO_THREAD
 	bdev_io_thread_notify_exit(bdev);
 	pthread_join(bdev->bd_bh_io_thread, NULL);
 #endif
 	
-	pthread_mutex_lock(&bdev->bd_bh_root_lock);
-	while ((node = rb_first(&bdev->bd_bh_root))) {
-		struct buffer_head *bh = rb_entry(
-		    node, struct buffer_head, b_rb_node);
-		wait_on_buffer(bh);
-		detach_bh_from_freelist(bh);
-		__buffer_remove(bdev, bh);
-		buffer_free(bh);
+	while (bdev->bd_nr_inflight)
+		sched_yield();
+
+	/* While the policy still has the buffers on its lists */
+	bdev_showstat(bdev);
+
+	for (i = 0; i < BH_HASH_SHARDS; i++) {
+		struct bh_hash_shard *shard = &bdev->bd_bh_hash[i];
+
+		pthread_mutex_lock(&shard->bs_lock);
+		for (j = 0; j < shard->bs_size; j++) {
+			struct buffer_head *bh = shard->bs_slots[j];
+			if (!bh)
+				continue;
+			detach_bh_from_freelist(bh);
+			remove_buffer_from_writeback(bh);
+		}
+		free(shard->bs_slots);
+		pthread_mutex_unlock(&shard->bs_lock);
+		pthread_mutex_destroy(&shard->bs_lock);
 	}
-	pthread_mutex_unlock(&bdev->bd_bh_root_lock);
+
+	bdev->bd_policy->exit(bdev);
+
+#ifdef USE_IO_URING
+	/* Nothing is in flight any more, wake the reaper up to exit. */
+	bdev->bd_uring_exiting = 1;
+	uring_queue_nop(&bdev->bd_uring, NULL);
+	uring_submit(&bdev->bd_uring);
+	pthread_join(bdev->bd_uring_reap_thread, NULL);
+	uring_exit(&bdev->bd_uring);
+#endif
+
+	bh_chunks_free(bdev);
 
 	if (bdev->bd_nr_free != 0)
 		WARNING("bdev->bd_nr_free == %d", bdev->bd_nr_free);
 
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 	close(bdev->bd_bh_io_wakeup_fd[0]);
 	close(bdev->bd_bh_io_wakeup_fd[1]);
 #endif
@@ -377,63 +659,209 @@ void bdev_free(struct block_device *bdev)
 	close(bdev->bd_bh_writeback_wakeup_fd[1]);
 
 	pthread_mutex_destroy(&bdev->bd_bh_free_lock);
+	pthread_mutex_destroy(&bdev->bd_bh_pool_lock);
+	pthread_cond_destroy(&bdev->bd_bh_free_wait);
 	pthread_mutex_destroy(&bdev->bd_bh_dirty_lock);
-#ifndef USE_AIO
+	pthread_cond_destroy(&bdev->bd_dirty_wait);
+#ifdef USE_IO_THREAD
 	pthread_mutex_destroy(&bdev->bd_bh_ioqueue_lock);
 #endif
-	pthread_mutex_destroy(&bdev->bd_bh_root_lock);
 
 	free(bdev);
 }
 
 
-static void sync_writeback_buffers(struct block_device *bdev)
+
+/*
+ * Buffers are carved out of chunks of BH_CHUNK_NR descriptors, whose
+ * data lives in one page aligned arena.  A buffer keeps its descriptor,
+ * data, lock and semaphore for its whole life: when it leaves the cache
+ * it goes back to bd_bh_pool, and the chunks are only released by
+ * bdev_free().
+ */
+#define BH_CHUNK_NR 64
+
+struct bh_chunk {
+	struct list_head bc_list;
+	char *bc_data;
+	struct buffer_head bc_bhs[BH_CHUNK_NR];
+};
+
+/* Called with bd_bh_pool_lock held. */
+static int bh_chunk_alloc(struct block_device *bdev)
 {
-	if (buffer_dirty_count > buffer_dirty_threshold)
-		bdev_writeback_thread_notify(bdev);
+	size_t blocksize = bdev->bd_super->s_blocksize;
+	struct bh_chunk *chunk;
+	int i;
+
+	chunk = malloc(sizeof(struct bh_chunk));
+	if (!chunk)
+		return -ENOMEM;
+
+	if (posix_memalign((void **)&chunk->bc_data, sysconf(_SC_PAGESIZE),
+			   BH_CHUNK_NR * blocksize)) {
+		free(chunk);
+		return -ENOMEM;
+	}
+
+	memset(chunk->bc_bhs, 0, sizeof(chunk->bc_bhs));
+	for (i = 0; i < BH_CHUNK_NR; i++) {
+		struct buffer_head *bh = &chunk->bc_bhs[i];
+
+		bh->b_bdev = bdev;
+		bh->b_data = chunk->bc_data + i * blocksize;
+		bh->b_size = blocksize;
+		bh->b_page = NULL;
+
+		sem_init(&bh->b_event, 0, 1);
+
+		pthread_mutex_init(&bh->b_lock, NULL);
+		INIT_LIST_HEAD(&bh->b_freelist);
+		INIT_LIST_HEAD(&bh->b_dirty_list);
+		INIT_LIST_HEAD(&bh->b_io_list);
+
+		list_add_tail(&bh->b_freelist, &bdev->bd_bh_pool);
+	}
+	list_add_tail(&chunk->bc_list, &bdev->bd_bh_chunks);
+
+	return 0;
 }
 
+static void bh_chunks_free(struct block_device *bdev)
+{
+	struct bh_chunk *chunk, *tmp;
+	int i;
 
-struct buffer_head *buffer_alloc(struct block_device *bdev, uint64_t block,
-				 int page_size)
+	list_for_each_entry_safe(chunk, tmp, &bdev->bd_bh_chunks, bc_list) {
+		for (i = 0; i < BH_CHUNK_NR; i++) {
+			sem_destroy(&chunk->bc_bhs[i].b_event);
+			pthread_mutex_destroy(&chunk->bc_bhs[i].b_lock);
+		}
+		list_del(&chunk->bc_list);
+		free(chunk->bc_data);
+		free(chunk);
+	}
+}
+
+/*
+ * Take a buffer from the pool.  Fails with -ENOSPC if the budget is
+ * used up.
+ */
+static int bh_pool_get(struct block_device *bdev, struct buffer_head **bhp)
 {
-	struct buffer_head *bh;
-	bh = malloc(sizeof(struct buffer_head) + page_size);
-	if (!bh)
-		return NULL;
+	if (__sync_add_and_fetch(&bdev->bd_nr_buffers, 1) >
+	    bdev->bd_max_buffers) {
+		__sync_fetch_and_sub(&bdev->bd_nr_buffers, 1);
+		return -ENOSPC;
+	}
 
-	memset(bh, 0, sizeof(struct buffer_head));
-	bh->b_bdev = bdev;
-	bh->b_data = (char *)(bh + 1);
-	bh->b_size = page_size;
-	bh->b_blocknr = block;
-	bh->b_count = 0;
-	bh->b_page = NULL;
+	pthread_mutex_lock(&bdev->bd_bh_pool_lock);
+	if (list_empty(&bdev->bd_bh_pool) && bh_chunk_alloc(bdev) < 0) {
+		pthread_mutex_unlock(&bdev->bd_bh_pool_lock);
+		__sync_fetch_and_sub(&bdev->bd_nr_buffers, 1);
+		return -ENOMEM;
+	}
+	*bhp = list_first_entry(&bdev->bd_bh_pool,
+				struct buffer_head, b_freelist);
+	list_del_init(&(*bhp)->b_freelist);
+	pthread_mutex_unlock(&bdev->bd_bh_pool_lock);
 
-	sem_init(&bh->b_event, 0, 1);
+	return 0;
+}
 
-	pthread_mutex_init(&bh->b_lock, NULL);
-	INIT_LIST_HEAD(&bh->b_freelist);
-	INIT_LIST_HEAD(&bh->b_dirty_list);
+static struct buffer_head *try_to_drop_buffers(struct block_device *bdev);
 
-#ifndef USE_AIO
-	INIT_LIST_HEAD(&bh->b_io_list);
-#endif
+/*
+ * The budget is used up by buffers which are dirty or in use.  Kick the
+ * writeback thread and wait for one of them to be released clean.
+ */
+static void bdev_wait_for_buffers(struct block_device *bdev)
+{
+	struct timespec ts;
+
+	bdev_writeback_thread_notify_sync(bdev);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100 * 1000 * 1000;
+	if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000 * 1000 * 1000;
+	}
+
+	pthread_mutex_lock(&bdev->bd_bh_free_lock);
+	if (!bdev->bd_nr_free &&
+	    bdev->bd_nr_buffers >= bdev->bd_max_buffers) {
+		bdev->bd_nr_waiting++;
+		pthread_cond_timedwait(&bdev->bd_bh_free_wait,
+				       &bdev->bd_bh_free_lock, &ts);
+		bdev->bd_nr_waiting--;
+	}
+	pthread_mutex_unlock(&bdev->bd_bh_free_lock);
+}
+
+/*
+ * Get a buffer for @block.  Buffers are taken from the pool until the
+ * budget is used up, after which the policy's victim is evicted and
+ * reused in place.  If every buffer is dirty or in use, wait for the
+ * writeback to clean some of them, unless @nowait is set.
+ */
+static struct buffer_head *__buffer_alloc(struct block_device *bdev,
+					  uint64_t block, int page_size,
+					  int nowait)
+{
+	struct buffer_head *bh;
+	int ret;
+
+	ASSERT((size_t)page_size == bdev->bd_super->s_blocksize);
 
-	sync_writeback_buffers(bdev);
+	for (;;) {
+		ret = bh_pool_get(bdev, &bh);
+		if (!ret)
+			break;
+		if (ret != -ENOSPC)
+			return NULL;
+		bh = try_to_drop_buffers(bdev);
+		if (bh)
+			break;
+		if (nowait)
+			return NULL;
+		bdev_wait_for_buffers(bdev);
+	}
+
+	bh->b_state = 0;
+	bh->b_blocknr = block;
+	bh->b_count = 0;
+	bh->b_end_io = NULL;
+	bh->b_private = NULL;
 
 	return bh;
 }
 
+struct buffer_head *buffer_alloc(struct block_device *bdev, uint64_t block,
+				 int page_size)
+{
+	return __buffer_alloc(bdev, block, page_size, 0);
+}
+
+/*
+ * Give a buffer which is not in the cache back to the pool.
+ */
 static void buffer_free(struct buffer_head *bh)
 {
-	sem_destroy(&bh->b_event);
-	pthread_mutex_destroy(&bh->b_lock);
+	struct block_device *bdev = bh->b_bdev;
 
 	if (bh->b_count != 0)
 		WARNING("bh: %p b_count != 0, my pid: %d", bh, getpid());
 
-	free(bh);
+	pthread_mutex_lock(&bdev->bd_bh_pool_lock);
+	list_add(&bh->b_freelist, &bdev->bd_bh_pool);
+	pthread_mutex_unlock(&bdev->bd_bh_pool_lock);
+	__sync_fetch_and_sub(&bdev->bd_nr_buffers, 1);
+
+	pthread_mutex_lock(&bdev->bd_bh_free_lock);
+	if (bdev->bd_nr_waiting)
+		pthread_cond_broadcast(&bdev->bd_bh_free_wait);
+	pthread_mutex_unlock(&bdev->bd_bh_free_lock);
 }
 
 
@@ -441,91 +869,187 @@ static void
 attach_bh_to_freelist(struct buffer_head *bh)
 {
 	struct block_device *bdev = bh->b_bdev;
+	pthread_mutex_lock(&bdev->bd_bh_free_lock);
 	if (list_empty(&bh->b_freelist)) {
-		pthread_mutex_lock(&bdev->bd_bh_free_lock);
-		list_add_tail(&bh->b_freelist, &bh->b_bdev->bd_bh_free);
-		bh->b_bdev->bd_nr_free++;
-		pthread_mutex_unlock(&bdev->bd_bh_free_lock);
+		bdev->bd_policy->attach(bdev, bh);
+		bdev->bd_nr_free++;
+		if (bdev->bd_nr_waiting)
+			pthread_cond_broadcast(&bdev->bd_bh_free_wait);
 	}
+	pthread_mutex_unlock(&bdev->bd_bh_free_lock);
 }
 
 static void
 detach_bh_from_freelist(struct buffer_head *bh)
 {
 	struct block_device *bdev = bh->b_bdev;
+	pthread_mutex_lock(&bdev->bd_bh_free_lock);
 	if (!list_empty(&bh->b_freelist)) {
-		pthread_mutex_lock(&bdev->bd_bh_free_lock);
-		list_del_init(&bh->b_freelist);
-		bh->b_bdev->bd_nr_free--;
-		pthread_mutex_unlock(&bdev->bd_bh_free_lock);
+		bdev->bd_policy->detach(bdev, bh);
+		bdev->bd_nr_free--;
 	}
+	pthread_mutex_unlock(&bdev->bd_bh_free_lock);
 }
 
-static void
+/*
+ * Take the victim chosen by the replacement policy out of the cache
+ * and return it, or NULL if it turned out to be still in use.
+ *
+ * Lock ordering: the shard lock is taken before bd_bh_free_lock, so
+ * the victim is looked up again once both are held.  It may have been
+ * picked up again by __getblk() in the meantime, which takes its
+ * reference under the shard lock, so that is where b_count is checked.
+ * Buffer descriptors are never freed while the device exists, so it is
+ * safe to look at the victim without holding a lock.
+ */
+static struct buffer_head *
 remove_first_bh_from_freelist(struct block_device *bdev)
 {
+	struct bh_hash_shard *shard;
 	struct buffer_head *bh;
+	uint64_t blocknr;
 
 	pthread_mutex_lock(&bdev->bd_bh_free_lock);
-	if (list_empty(&bdev->bd_bh_free)) {
+	bh = bdev->bd_policy->victim(bdev);
+	if (!bh) {
 		pthread_mutex_unlock(&bdev->bd_bh_free_lock);
-		return;
+		return NULL;
 	}
-	bh = list_first_entry(&bdev->bd_bh_free,
-			      struct buffer_head, b_freelist);
-	list_del_init(&bh->b_freelist);
-	bh->b_bdev->bd_nr_free--;
+	blocknr = bh->b_blocknr;
 	pthread_mutex_unlock(&bdev->bd_bh_free_lock);
 
-	pthread_mutex_lock(&bdev->bd_bh_root_lock);
-	__buffer_remove(bdev, bh);
-	pthread_mutex_unlock(&bdev->bd_bh_root_lock);
-	buffer_free(bh);
+	shard = bh_hash_shard(bdev, blocknr);
+	pthread_mutex_lock(&shard->bs_lock);
+	pthread_mutex_lock(&bdev->bd_bh_free_lock);
+	if (__buffer_search(shard, blocknr) != bh ||
+	    list_empty(&bh->b_freelist)) {
+		/* Lost a race against another reclaimer, let the caller
+		 * try again. */
+		pthread_mutex_unlock(&bdev->bd_bh_free_lock);
+		pthread_mutex_unlock(&shard->bs_lock);
+		return NULL;
+	}
+	if (bh->b_count || buffer_dirty(bh)) {
+		/* Still in use, it will be reattached by brelse(). */
+		bdev->bd_policy->detach(bdev, bh);
+		bdev->bd_nr_free--;
+		pthread_mutex_unlock(&bdev->bd_bh_free_lock);
+		pthread_mutex_unlock(&shard->bs_lock);
+		return NULL;
+	}
+	bdev->bd_policy->evict(bdev, bh);
+	bdev->bd_nr_free--;
+	bdev->bd_nr_evictions++;
+	pthread_mutex_unlock(&bdev->bd_bh_free_lock);
+
+	__buffer_remove(shard, bh);
+	pthread_mutex_unlock(&shard->bs_lock);
+
+	return bh;
 }
 
 
 static void move_buffer_to_writeback(struct buffer_head *bh)
 {
 	struct block_device *bdev = bh->b_bdev;
+	int kick = 0;
+
 	pthread_mutex_lock(&bdev->bd_bh_dirty_lock);
 	if (list_empty(&bh->b_dirty_list)) {
+		bh->b_dirtied_ms = bdev_now_ms();
 		list_add_tail(&bh->b_dirty_list, &bh->b_bdev->bd_bh_dirty);
-		buffer_dirty_count++;
+		kick = ++bdev->bd_nr_dirty > bdev->bd_dirty_background;
 	}
 	pthread_mutex_unlock(&bdev->bd_bh_dirty_lock);
+
+	if (kick)
+		bdev_writeback_thread_notify(bdev);
+}
+
+/* Called with bd_bh_dirty_lock held. */
+static void __remove_buffer_from_writeback(struct buffer_head *bh)
+{
+	struct block_device *bdev = bh->b_bdev;
+
+	list_del_init(&bh->b_dirty_list);
+	bdev->bd_nr_dirty--;
+	if (bdev->bd_nr_dirty_waiting &&
+	    bdev->bd_nr_dirty <= bdev->bd_dirty_limit)
+		pthread_cond_broadcast(&bdev->bd_dirty_wait);
 }
 
+/*
+ * Take the oldest dirty buffer that is not in use off the dirty list.
+ * Unless @all is set, that is only done while there are more dirty
+ * buffers than the background threshold, or if it has been dirty for
+ * too long.  Buffers in use stay where they are, to be written once
+ * they are released.
+ */
 static struct buffer_head *
-remove_first_buffer_from_writeback(struct block_device *bdev)
+remove_first_buffer_from_writeback(struct block_device *bdev, int all)
 {
 	struct buffer_head *bh;
 
 	pthread_mutex_lock(&bdev->bd_bh_dirty_lock);
-	if (list_empty(&bdev->bd_bh_dirty)) {
+	list_for_each_entry(bh, &bdev->bd_bh_dirty, b_dirty_list) {
+		if (bh->b_count > 0)
+			continue;
+		if (!all && bdev->bd_nr_dirty <= bdev->bd_dirty_background &&
+		    bdev_now_ms() - bh->b_dirtied_ms < bdev->bd_dirty_expire_ms)
+			break;
+		__remove_buffer_from_writeback(bh);
 		pthread_mutex_unlock(&bdev->bd_bh_dirty_lock);
-		return NULL;
+		return bh;
 	}
-	bh = list_first_entry(&bdev->bd_bh_dirty,
-			      struct buffer_head, b_dirty_list);
-	list_del_init(&bh->b_dirty_list);
-	buffer_dirty_count--;
 	pthread_mutex_unlock(&bdev->bd_bh_dirty_lock);
 
-	return bh;
+	return NULL;
 }
 
 static void remove_buffer_from_writeback(struct buffer_head *bh)
 {
 	struct block_device *bdev = bh->b_bdev;
 	pthread_mutex_lock(&bdev->bd_bh_dirty_lock);
-	if (!list_empty(&bh->b_dirty_list)) {
-		list_del_init(&bh->b_dirty_list);
-		buffer_dirty_count--;
+	if (!list_empty(&bh->b_dirty_list))
+		__remove_buffer_from_writeback(bh);
+	pthread_mutex_unlock(&bdev->bd_bh_dirty_lock);
+}
+
+/*
+ * Throttle writers while there are more dirty buffers than
+ * bd_dirty_limit.  Must not be called with buffers held.
+ */
+void bdev_balance_dirty(struct block_device *bdev)
+{
+	struct timespec ts;
+
+	if (bdev->bd_nr_dirty <= bdev->bd_dirty_limit)
+		return;
+
+	pthread_mutex_lock(&bdev->bd_bh_dirty_lock);
+	while (bdev->bd_nr_dirty > bdev->bd_dirty_limit) {
+		pthread_mutex_unlock(&bdev->bd_bh_dirty_lock);
+		bdev_writeback_thread_notify(bdev);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000 * 1000 * 1000;
+		}
+
+		pthread_mutex_lock(&bdev->bd_bh_dirty_lock);
+		if (bdev->bd_nr_dirty <= bdev->bd_dirty_limit)
+			break;
+		bdev->bd_nr_dirty_waiting++;
+		pthread_cond_timedwait(&bdev->bd_dirty_wait,
+				       &bdev->bd_bh_dirty_lock, &ts);
+		bdev->bd_nr_dirty_waiting--;
 	}
 	pthread_mutex_unlock(&bdev->bd_bh_dirty_lock);
 }
 
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 
 static void add_buffer_to_ioqueue(struct buffer_head *bh)
 {
@@ -558,17 +1082,50 @@ remove_first_buffer_from_ioqueue(struct block_device *bdev)
 #endif
 
 
-static void try_to_drop_buffers(struct block_device *bdev)
+/*
+ * Evict a buffer from the freelist, which is returned to be reused by
+ * the caller.
+ */
+static struct buffer_head *try_to_drop_buffers(struct block_device *bdev)
 {
-	while (bdev->bd_nr_free > buffer_free_threshold) {
-		remove_first_bh_from_freelist(bdev);
+	struct buffer_head *bh = NULL;
+
+	while (!bh && bdev->bd_nr_free)
+		bh = remove_first_bh_from_freelist(bdev);
+
+	return bh;
+}
+
+/*
+ * Drop a reference.  The last one is dropped under the shard lock
+ * together with queueing the buffer for reclaim or writeback, so that
+ * reclaim can never free a buffer somebody is still looking at.
+ */
+static void buffer_put(struct buffer_head *bh)
+{
+	struct bh_hash_shard *shard = bh_hash_shard(bh->b_bdev, bh->b_blocknr);
+
+	pthread_mutex_lock(&shard->bs_lock);
+	if (put_bh_and_read(bh) == 0) {
+		if (!buffer_dirty(bh))
+			attach_bh_to_freelist(bh);
+		else
+			move_buffer_to_writeback(bh);
 	}
+	pthread_mutex_unlock(&shard->bs_lock);
 }
 
-static void reclaim_buffer(struct buffer_head *bh)
+/*
+ * Complete an I/O submitted by __submit_bh().  bd_nr_inflight is only
+ * dropped once b_end_io is done with the buffer, which lets bdev_free()
+ * wait for the completions that are still running.
+ */
+static void bh_end_io(struct buffer_head *bh, int uptodate)
 {
-	try_to_drop_buffers(bh->b_bdev);
-	attach_bh_to_freelist(bh);
+	struct block_device *bdev = bh->b_bdev;
+
+	bh->b_end_io(bh, uptodate);
+	__sync_fetch_and_sub(&bdev->bd_nr_inflight, 1);
 }
 
 #ifdef USE_AIO
@@ -583,9 +1140,40 @@ void iocb_dispatch(union sigval value)
 
 	err = aio_error(&bh->b_aiocb);
 	if (err < 0)
-		bh->b_end_io(bh, 0);
+		bh_end_io(bh, 0);
+	else
+		bh_end_io(bh, 1);
+}
+
+#endif
+
+#ifdef USE_IO_URING
+
+/*
+ * All completions of a block device are reaped here, and b_end_io is
+ * called from this thread.
+ */
+static void uring_dispatch(void *data, int res)
+{
+	struct buffer_head *bh = data;
+	if (!bh)
+		return;
+
+	if (res != (int)bh->b_size)
+		bh_end_io(bh, 0);
 	else
-		bh->b_end_io(bh, 1);
+		bh_end_io(bh, 1);
+}
+
+static void *buffer_uring_reap_thread(void *arg)
+{
+	struct block_device *bdev = arg;
+
+	while (!bdev->bd_uring_exiting) {
+		if (uring_reap(&bdev->bd_uring, uring_dispatch) < 0)
+			break;
+	}
+	return NULL;
 }
 
 #endif
@@ -594,10 +1182,33 @@ void wait_on_buffer(struct buffer_head *bh)
 {
 	/*const struct aiocb const *aiocb_list[2] = {&bh->b_aiocb, NULL};*/
 	/*aio_suspend(aiocb_list, 1, NULL);*/
+#ifdef USE_IO_URING
+	if (!sem_trywait(&bh->b_event)) {
+		sem_post(&bh->b_event);
+		return;
+	}
+	/* The request might still be sitting in the submission queue. */
+	uring_submit(&bh->b_bdev->bd_uring);
+#endif
 	sem_wait(&bh->b_event);
 	sem_post(&bh->b_event);
 }
 
+/*
+ * Make sure the requests submitted so far are on their way to the
+ * device.  io_uring requests may sit in the submission queue until
+ * somebody waits on them, which is fine as long as the submitter waits
+ * itself; anybody else needs this.
+ */
+void bdev_unplug(struct block_device *bdev)
+{
+#ifdef USE_IO_URING
+	uring_submit(&bdev->bd_uring);
+#else
+	UNUSED(bdev);
+#endif
+}
+
 /*
  * Submit an IO request.
  * FIXME: any calls to submit_bh are supposed to be non-blocking.
@@ -606,16 +1217,28 @@ int __submit_bh(int is_write, struct buffer_head *bh)
 {
 	struct block_device *bdev = bh->b_bdev;
 
+	__sync_fetch_and_add(&bdev->bd_nr_inflight, 1);
+
+#ifdef USE_IO_URING
+	int ret;
+	sem_wait(&bh->b_event);
+	ret = uring_queue_rw(&bdev->bd_uring, is_write, bdev->bd_fd,
+			     bh->b_data, bh->b_size,
+			     bh->b_blocknr * bh->b_size, bh);
+	if (ret < 0)
+		bh_end_io(bh, 0);
+	return ret;
+#else
 	if (is_write == 0) {
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 		int ret;
 		sem_wait(&bh->b_event);
 		ret = device_read(bdev->bd_fd, bh->b_blocknr, 1,
 				   bh->b_size, bh->b_data);
 		if (ret < 0)
-			bh->b_end_io(bh, 0);
+			bh_end_io(bh, 0);
 		else
-			bh->b_end_io(bh, 1);
+			bh_end_io(bh, 1);
 #else
 		bh->b_aiocb.aio_fildes = bdev->bd_fd;
 		bh->b_aiocb.aio_buf = bh->b_data;
@@ -629,15 +1252,15 @@ int __submit_bh(int is_write, struct buffer_head *bh)
 		aio_read(&bh->b_aiocb);
 #endif
 	} else {
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 		int ret;
 		sem_wait(&bh->b_event);
 		ret = device_write(bdev->bd_fd, bh->b_blocknr, 1,
 				   bh->b_size, bh->b_data);
 		if (ret < 0)
-			bh->b_end_io(bh, 0);
+			bh_end_io(bh, 0);
 		else
-			bh->b_end_io(bh, 1);
+			bh_end_io(bh, 1);
 #else
 		bh->b_aiocb.aio_fildes = bdev->bd_fd;
 		bh->b_aiocb.aio_buf = bh->b_data;
@@ -653,11 +1276,12 @@ int __submit_bh(int is_write, struct buffer_head *bh)
 	}
 
 	return 0;
+#endif
 }
 
 int submit_bh(int is_write, struct buffer_head *bh)
 {
-#ifdef USE_AIO
+#if defined(USE_AIO) || defined(USE_IO_URING)
 	return __submit_bh(is_write, bh);
 #else
 	if (is_write)
@@ -670,17 +1294,24 @@ int submit_bh(int is_write, struct buffer_head *bh)
 #endif
 }
 
+/*
+ * The completion handlers drop the reference taken for the I/O last,
+ * as the buffer may be reclaimed as soon as it is gone.
+ */
 void after_buffer_sync(struct buffer_head *bh, int uptodate)
 {
-	if (uptodate)
+	if (uptodate) {
 		set_buffer_uptodate(bh);
+	} else {
+		set_buffer_write_io_error(bh);
+		WARNING("Failed to write back block %llu",
+			(unsigned long long)bh->b_blocknr);
+	}
 
-	put_bh(bh);
 	remove_buffer_from_writeback(bh);
-	clear_buffer_dirty(bh);
-	attach_bh_to_freelist(bh);
 	unlock_buffer(bh);
 	sem_post(&bh->b_event);
+	buffer_put(bh);
 }
 
 void after_submit_read(struct buffer_head *bh, int uptodate)
@@ -688,9 +1319,9 @@ void after_submit_read(struct buffer_head *bh, int uptodate)
 	if (uptodate)
 		set_buffer_uptodate(bh);
 
-	put_bh(bh);
 	unlock_buffer(bh);
 	sem_post(&bh->b_event);
+	buffer_put(bh);
 }
 
 int bh_submit_read(struct buffer_head *bh)
@@ -711,79 +1342,343 @@ int bh_submit_read(struct buffer_head *bh)
 	return ret;
 }
 
-static int sync_dirty_buffer(struct buffer_head *bh)
+/*
+ * Read @nr buffers of physically contiguous blocks with a single
+ * preadv().  The buffers must have been locked by the caller, which
+ * also means that no other I/O is in flight on them.  They are unlocked
+ * on return.
+ */
+int bh_read_contig(struct buffer_head **bhs, int nr)
 {
-	int ret = 0;
+	struct iovec iov[BH_READ_CONTIG_MAX];
+	struct block_device *bdev;
+	size_t total = 0;
+	ssize_t ret;
+	int i;
+
+	ASSERT(nr > 0 && nr <= BH_READ_CONTIG_MAX);
+	bdev = bhs[0]->b_bdev;
+
+	for (i = 0; i < nr; i++) {
+		ASSERT(bhs[i]->b_blocknr == bhs[0]->b_blocknr + i);
+		sem_wait(&bhs[i]->b_event);
+		iov[i].iov_base = bhs[i]->b_data;
+		iov[i].iov_len = bhs[i]->b_size;
+		total += bhs[i]->b_size;
+	}
 
-	if (!trylock_buffer(bh))
-		return ret;
+	ret = preadv_wrapper(bdev->bd_fd, iov, nr,
+			     bhs[0]->b_blocknr * bhs[0]->b_size);
 
-	if (bh->b_count < 1 && buffer_dirty(bh)) {
-		get_bh(bh);
-		bh->b_end_io = after_buffer_sync;
-		ret = submit_bh(WRITE, bh);
-	} else {
-		unlock_buffer(bh);
+	for (i = 0; i < nr; i++) {
+		if (ret == (ssize_t)total)
+			set_buffer_uptodate(bhs[i]);
+		unlock_buffer(bhs[i]);
+		sem_post(&bhs[i]->b_event);
 	}
-	return ret;
+
+	if (ret < 0)
+		return -errno;
+	if (ret != (ssize_t)total)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * A run of buffers of contiguous blocks, written with a single
+ * pwritev() by one of the writer threads.  The runs of a batch point
+ * into the batch's sorted buffer array.
+ */
+struct wb_run {
+	struct list_head wr_list;
+	struct wb_batch *wr_batch;
+	struct buffer_head **wr_bhs;
+	int wr_nr;
+};
+
+struct wb_batch {
+	int wb_nr_pending;      /* runs not written yet */
+	struct buffer_head *wb_bhs[WB_BATCH];
+	struct wb_run wb_runs[WB_BATCH];
+};
+
+static void wb_run_write(struct block_device *bdev, struct wb_run *run)
+{
+	struct iovec iov[BH_WRITE_CONTIG_MAX];
+	size_t total = 0;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < run->wr_nr; i++) {
+		iov[i].iov_base = run->wr_bhs[i]->b_data;
+		iov[i].iov_len = run->wr_bhs[i]->b_size;
+		total += run->wr_bhs[i]->b_size;
+	}
+
+	ret = pwritev_wrapper(bdev->bd_fd, iov, run->wr_nr,
+			      run->wr_bhs[0]->b_blocknr * run->wr_bhs[0]->b_size);
+
+	for (i = 0; i < run->wr_nr; i++)
+		after_buffer_sync(run->wr_bhs[i], ret == (ssize_t)total);
 }
 
+static void *buffer_wb_writer_thread(void *arg)
+{
+	struct block_device *bdev = arg;
 
-struct buffer_head *__getblk(struct block_device *bdev, uint64_t block,
-			     int bsize)
+	pthread_mutex_lock(&bdev->bd_wb_lock);
+	while (1) {
+		struct wb_run *run;
+		struct wb_batch *batch;
+
+		while (list_empty(&bdev->bd_wb_runs) && !bdev->bd_wb_exiting)
+			pthread_cond_wait(&bdev->bd_wb_work, &bdev->bd_wb_lock);
+		if (list_empty(&bdev->bd_wb_runs))
+			break;
+
+		run = list_first_entry(&bdev->bd_wb_runs, struct wb_run,
+				       wr_list);
+		list_del(&run->wr_list);
+		pthread_mutex_unlock(&bdev->bd_wb_lock);
+
+		wb_run_write(bdev, run);
+
+		pthread_mutex_lock(&bdev->bd_wb_lock);
+		batch = run->wr_batch;
+		if (--batch->wb_nr_pending == 0) {
+			free(batch);
+			bdev->bd_wb_nr_batches--;
+			pthread_cond_broadcast(&bdev->bd_wb_done);
+		}
+	}
+	pthread_mutex_unlock(&bdev->bd_wb_lock);
+
+	return NULL;
+}
+
+static int bh_cmp_blocknr(const void *a, const void *b)
+{
+	const struct buffer_head *bha = *(struct buffer_head * const *)a;
+	const struct buffer_head *bhb = *(struct buffer_head * const *)b;
+
+	if (bha->b_blocknr < bhb->b_blocknr)
+		return -1;
+	return bha->b_blocknr > bhb->b_blocknr;
+}
+
+/*
+ * Take up to WB_BATCH buffers off the dirty list, see
+ * remove_first_buffer_from_writeback(), and prepare them for writing.
+ * The dirty bit is cleared before the write is submitted, so that
+ * redirtying the buffer while it is under I/O is not lost.
+ */
+static int wb_gather(struct block_device *bdev, struct buffer_head **bhs,
+		     int all)
+{
+	struct buffer_head *bh;
+	int nr = 0;
+
+	while (nr < WB_BATCH &&
+	       (bh = remove_first_buffer_from_writeback(bdev, all))) {
+		if (!trylock_buffer(bh))
+			continue;
+
+		if (bh->b_count < 1 && test_clear_buffer_dirty(bh)) {
+			/* The reference is dropped by after_buffer_sync() */
+			get_bh(bh);
+			sem_wait(&bh->b_event);
+			bhs[nr++] = bh;
+		} else {
+			unlock_buffer(bh);
+		}
+	}
+
+	return nr;
+}
+
+/*
+ * Sort @batch by block number, split it into runs of contiguous blocks
+ * and queue them for the writer threads.
+ */
+static void wb_submit(struct block_device *bdev, struct wb_batch *batch,
+		      int nr)
+{
+	int i, nr_runs = 0;
+
+	qsort(batch->wb_bhs, nr, sizeof(struct buffer_head *), bh_cmp_blocknr);
+
+	for (i = 0; i < nr; i++) {
+		struct wb_run *run;
+
+		if (nr_runs) {
+			run = &batch->wb_runs[nr_runs - 1];
+			if (run->wr_nr < BH_WRITE_CONTIG_MAX &&
+			    run->wr_bhs[run->wr_nr - 1]->b_blocknr + 1 ==
+			    batch->wb_bhs[i]->b_blocknr) {
+				run->wr_nr++;
+				continue;
+			}
+		}
+		run = &batch->wb_runs[nr_runs++];
+		run->wr_batch = batch;
+		run->wr_bhs = &batch->wb_bhs[i];
+		run->wr_nr = 1;
+	}
+
+	pthread_mutex_lock(&bdev->bd_wb_lock);
+	batch->wb_nr_pending = nr_runs;
+	bdev->bd_wb_nr_batches++;
+	for (i = 0; i < nr_runs; i++)
+		list_add_tail(&batch->wb_runs[i].wr_list, &bdev->bd_wb_runs);
+	pthread_cond_broadcast(&bdev->bd_wb_work);
+	pthread_mutex_unlock(&bdev->bd_wb_lock);
+}
+
+/*
+ * Wait until fewer than @max batches are in flight.
+ */
+static void wb_wait_batches(struct block_device *bdev, int max)
+{
+	pthread_mutex_lock(&bdev->bd_wb_lock);
+	while (bdev->bd_wb_nr_batches >= max)
+		pthread_cond_wait(&bdev->bd_wb_done, &bdev->bd_wb_lock);
+	pthread_mutex_unlock(&bdev->bd_wb_lock);
+}
+
+
+/* getblk() flags */
+#define GETBLK_NOWAIT		(1 << 0)	/* fail rather than wait for room */
+#define GETBLK_NOREF		(1 << 1)	/* not a use of the block */
+
+/*
+ * A lookup that finds @bh cached.  Readahead doesn't count as a use of
+ * the block, and neither does the first lookup after it, which is the
+ * one the block was read ahead for: otherwise every block of a file
+ * read once would look used twice to the policy.
+ */
+static void getblk_hit(struct block_device *bdev, struct buffer_head *bh,
+		       int flags)
+{
+	__sync_fetch_and_add(&bdev->bd_nr_hits, 1);
+	if (!(flags & GETBLK_NOREF) && !test_clear_buffer_readahead(bh))
+		set_buffer_referenced(bh);
+	/* A dirty buffer stays queued for writeback, and keeps its age */
+	detach_bh_from_freelist(bh);
+}
+
+static struct buffer_head *getblk(struct block_device *bdev, uint64_t block,
+				  int bsize, int flags)
 {
 	struct buffer_head *bh;
 
+	struct buffer_head *new_bh;
+
 	bh = buffer_search(bdev, block);
 	if (bh) {
-		detach_bh_from_freelist(bh);
-		remove_buffer_from_writeback(bh);
-		get_bh(bh);
+		getblk_hit(bdev, bh, flags);
 		return bh;
 	}
-	bh = buffer_alloc(bdev, block, bsize);
-	if (bh == NULL)
+	new_bh = __buffer_alloc(bdev, block, bsize, flags & GETBLK_NOWAIT);
+	if (new_bh == NULL)
+		return NULL;
+
+	bh = buffer_insert(bdev, new_bh);
+	if (!bh) {
+		buffer_free(new_bh);
 		return NULL;
+	}
+	if (bh != new_bh) {
+		/* Somebody else raced us to the same block. */
+		buffer_free(new_bh);
+		getblk_hit(bdev, bh, flags);
+		return bh;
+	}
 
-	buffer_insert(bdev, bh);
+	__sync_fetch_and_add(&bdev->bd_nr_misses, 1);
+	pthread_mutex_lock(&bdev->bd_bh_free_lock);
+	bdev->bd_policy->miss(bdev, bh);
+	pthread_mutex_unlock(&bdev->bd_bh_free_lock);
 
-	get_bh(bh);
 	return bh;
 }
 
+struct buffer_head *__getblk(struct block_device *bdev, uint64_t block,
+			     int bsize)
+{
+	return getblk(bdev, block, bsize, 0);
+}
+
+/*
+ * Like __getblk(), but fail instead of waiting for writeback when the
+ * cache is full.  For callers that already hold other buffers, which
+ * could otherwise pin the whole budget between them.
+ */
+struct buffer_head *__getblk_nowait(struct block_device *bdev,
+				    uint64_t block, int bsize)
+{
+	return getblk(bdev, block, bsize, GETBLK_NOWAIT);
+}
+
+/*
+ * Like __getblk_nowait(), but the lookup doesn't count as a use of the
+ * block for the replacement policy.  For readahead, which sets
+ * BH_Readahead on the buffers it reads, and for peeking at the blocks
+ * after the one being read.
+ */
+struct buffer_head *__getblk_noref(struct block_device *bdev,
+				   uint64_t block, int bsize)
+{
+	return getblk(bdev, block, bsize, GETBLK_NOWAIT | GETBLK_NOREF);
+}
+
+void bdev_showstat(struct block_device *bdev)
+{
+	unsigned long lookups = bdev->bd_nr_hits + bdev->bd_nr_misses;
+
+	INFO("%s: %lu hits, %lu misses (%lu%% hit rate), %lu evictions, "
+	     "%lu/%lu buffers",
+	     bdev->bd_policy->name, bdev->bd_nr_hits, bdev->bd_nr_misses,
+	     lookups ? bdev->bd_nr_hits * 100 / lookups : 0,
+	     bdev->bd_nr_evictions, bdev->bd_nr_buffers,
+	     bdev->bd_max_buffers);
+	bdev->bd_policy->showstat(bdev);
+}
+
 /*
  * Release the buffer_head.
  */
 void brelse(struct buffer_head *bh)
 {
-	int refcount;
 	if (bh == NULL)
 		return;
-	refcount = put_bh_and_read(bh);
-	if (refcount >= 1)
-		goto out;
-	assert(refcount == 0);
 
-	if (!buffer_dirty(bh))
-		reclaim_buffer(bh);
-	else
-		move_buffer_to_writeback(bh);
-out:
-	return;
+	buffer_put(bh);
 }
 
 
-static void try_to_sync_buffers(struct block_device *bdev)
+/*
+ * Write back dirty buffers.  With @all clear, only what is needed to
+ * get below the background threshold and what has expired is written.
+ */
+static void try_to_sync_buffers(struct block_device *bdev, int all)
 {
 	while (1) {
-		struct buffer_head *cur;
-		cur = remove_first_buffer_from_writeback(bdev);
-		if (cur) {
-			sync_dirty_buffer(cur);
-			wait_on_buffer(cur);
-		} else
-			break;
+		struct wb_batch *batch;
+		int nr;
 
+		wb_wait_batches(bdev, WB_MAX_BATCHES);
+
+		batch = malloc(sizeof(struct wb_batch));
+		if (!batch) {
+			WARNING("Out of memory, writeback postponed");
+			break;
+		}
+		nr = wb_gather(bdev, batch->wb_bhs, all);
+		if (!nr) {
+			free(batch);
+			break;
+		}
+		wb_submit(bdev, batch, nr);
 	}
 }
 
@@ -800,20 +1695,25 @@ static void *buffer_writeback_thread(void *arg)
 
 	while (1) {
 		int ret;
-		ret = epoll_wait(epfd, &epev, 1, buffer_writeback_ms);
+		ret = epoll_wait(epfd, &epev, 1, WB_INTERVAL_MS);
 		if (ret > 0) {
 			/* We got an nofication. */
 			signed char command;
 			command = bdev_writeback_thread_read_notify(bdev);
-			try_to_sync_buffers(bdev);
-			if (bdev_is_notify_exiting(command))
+			__sync_lock_release(&bdev->bd_wb_kicked);
+			try_to_sync_buffers(bdev,
+					    bdev_is_notify_exiting(command) ||
+					    bdev_is_notify_sync(command));
+			if (bdev_is_notify_exiting(command)) {
+				wb_wait_batches(bdev, 1);
 				break;
+			}
 			
 			continue;
 		}
 		if (ret == 0) {
-			/* just flush out the dirty data. */
-			try_to_sync_buffers(bdev);
+			/* just flush out the expired dirty data. */
+			try_to_sync_buffers(bdev, 0);
 		}
 		if (ret < 0 && errno != EINTR)
 			break;
@@ -823,7 +1723,7 @@ static void *buffer_writeback_thread(void *arg)
 	return NULL;
 }
 
-#ifndef USE_AIO
+#ifdef USE_IO_THREAD
 
 static void try_to_perform_io(struct block_device *bdev)
 {
@@ -6,14 +6,28 @@
 #include <semaphore.h>
 #include <errno.h>
 
+/*
+ * Block I/O backend: io_uring when built with USE_IO_URING, POSIX AIO
+ * otherwise.  Without either, I/O is done synchronously by an I/O thread.
+ */
+#ifndef USE_IO_URING
 #define USE_AIO
+#endif
+
 #ifdef USE_AIO
 #include <aio.h>
 #include <signal.h>
 #endif
 
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+
+#if !defined(USE_AIO) && !defined(USE_IO_URING)
+#define USE_IO_THREAD
+#endif
+
 #include "common.h"
-#include "types/rbtree.h"
 #include "types/list.h"
 #include "disk.h"
 #include "bitmap.h"
@@ -47,11 +61,59 @@ enum bh_state_bits {
 	      * for private allocation by other entities
 	      */
 	BH_Ordered,
-	BH_Eopnotsupp
+	BH_Eopnotsupp,
+	BH_Referenced,	     /* Looked up again since it was last released */
+	BH_Hot,		     /* On the frequently used side of the policy */
+	BH_Readahead	     /* Read ahead, not looked up since */
 };
 
 struct super_block;
 struct buffer_head;
+struct block_device;
+
+/* One shard of the block number -> buffer_head index, see buffer.c */
+#define BH_HASH_SHARD_BITS 6
+#define BH_HASH_SHARDS (1 << BH_HASH_SHARD_BITS)
+
+struct bh_hash_shard {
+	pthread_mutex_t bs_lock;
+	unsigned int bs_nr;             /* buffers in the shard */
+	unsigned int bs_size;           /* slots, a power of two */
+	struct buffer_head **bs_slots;
+};
+
+/*
+ * Replacement policy of the buffers on the freelist, see bufpolicy.c.
+ * All hooks but init and exit are called with bd_bh_free_lock held, and
+ * b_freelist is the policy's to link the buffer into its own lists.
+ */
+struct bh_policy {
+	const char *name;
+	int (*init)(struct block_device *bdev, unsigned long capacity);
+	void (*exit)(struct block_device *bdev);
+	/* @bh was just inserted for a block that missed the cache */
+	void (*miss)(struct block_device *bdev, struct buffer_head *bh);
+	/* @bh was released and can be evicted */
+	void (*attach)(struct block_device *bdev, struct buffer_head *bh);
+	/* @bh is about to be used again */
+	void (*detach)(struct block_device *bdev, struct buffer_head *bh);
+	/* Next buffer to evict, which stays attached until evict is called */
+	struct buffer_head *(*victim)(struct block_device *bdev);
+	void (*evict)(struct block_device *bdev, struct buffer_head *bh);
+	void (*showstat)(struct block_device *bdev);
+};
+
+const struct bh_policy *bh_policy_find(const char *name);
+
+/*
+ * Writeback gathers up to WB_BATCH dirty buffers at a time, and writes
+ * each run of contiguous blocks of a batch with one pwritev() from one
+ * of WB_NR_WRITERS threads.  Up to WB_MAX_BATCHES batches are in flight.
+ */
+#define WB_BATCH 1024
+#define WB_NR_WRITERS 4
+#define WB_MAX_BATCHES 4
+
 struct block_device {
 	int bd_fd;
 	unsigned long bd_flags; /* flags */
@@ -60,15 +122,67 @@ struct block_device {
 	int bd_nr_free;
 	pthread_mutex_t bd_bh_free_lock;
 	struct list_head bd_bh_free;
-
+	const struct bh_policy *bd_policy;
+	void *bd_policy_data;
+
+	/* Lookups in the cache */
+	unsigned long bd_nr_hits;
+	unsigned long bd_nr_misses;
+	unsigned long bd_nr_evictions;
+
+	/* Buffers not in the cache, and the chunks they are carved from */
+	pthread_mutex_t bd_bh_pool_lock;
+	struct list_head bd_bh_pool;
+	struct list_head bd_bh_chunks;
+
+	/*
+	 * Memory budget: at most bd_max_buffers buffers, clean, dirty or in
+	 * use, are taken from the pool.  Allocations wait on bd_bh_free_wait
+	 * (under bd_bh_free_lock) when none of them can be evicted.
+	 */
+	unsigned long bd_max_buffers;
+	unsigned long bd_nr_buffers;
+	int bd_nr_waiting;
+	pthread_cond_t bd_bh_free_wait;
+
+	/*
+	 * bd_bh_dirty is ordered by the time the buffers were first
+	 * released dirty; looking them up again leaves them on it until
+	 * they are written back.  Writeback starts once bd_nr_dirty
+	 * passes bd_dirty_background, or when the oldest buffer not in
+	 * use has been dirty for bd_dirty_expire_ms, and writers are
+	 * throttled above bd_dirty_limit.
+	 */
 	pthread_mutex_t bd_bh_dirty_lock;
 	struct list_head bd_bh_dirty;
+	unsigned long bd_nr_dirty;
+	unsigned long bd_dirty_background;
+	unsigned long bd_dirty_limit;
+	unsigned long bd_dirty_expire_ms;
+	int bd_nr_dirty_waiting;
+	pthread_cond_t bd_dirty_wait;
+	int bd_wb_kicked;
+
+	pthread_mutex_t bd_wb_lock;
+	pthread_cond_t bd_wb_work;      /* runs queued, or exiting */
+	pthread_cond_t bd_wb_done;      /* a batch completed */
+	struct list_head bd_wb_runs;
+	int bd_wb_nr_batches;
+	int bd_wb_exiting;
+	pthread_t bd_wb_writers[WB_NR_WRITERS];
 
 	pthread_mutex_t bd_bh_ioqueue_lock;
 	struct list_head bd_bh_ioqueue;
 
-	pthread_mutex_t bd_bh_root_lock;
-	struct rb_root bd_bh_root;
+	struct bh_hash_shard bd_bh_hash[BH_HASH_SHARDS];
+
+	int bd_nr_inflight; /* submitted, but not completed I/Os */
+
+#ifdef USE_IO_URING
+	struct uring bd_uring;
+	int bd_uring_exiting;
+	pthread_t bd_uring_reap_thread;
+#endif
 
 	pthread_t bd_bh_io_thread;
 	pthread_t bd_bh_writeback_thread;
@@ -108,8 +222,8 @@ struct buffer_head
 
 #ifdef USE_AIO
 	struct aiocb b_aiocb;
-	sem_t b_event;
 #endif
+	sem_t b_event;
 
 	struct block_device *b_bdev;
 	bh_end_io_t *b_end_io; /* I/O completion */
@@ -118,28 +232,34 @@ struct buffer_head
 	atomic_t b_count; /* users using this buffer_head */
 	pthread_mutex_t b_lock;
 
+	unsigned long b_dirtied_ms; /* when it was put on bd_bh_dirty */
+
 	struct list_head b_io_list;
 	struct list_head b_dirty_list;
-	struct list_head b_freelist;
-	struct rb_node b_rb_node;
+	struct list_head b_freelist; /* also links the buffer into bd_bh_pool */
 };
 
 /*
  * macro tricks to expand the set_buffer_foo(), clear_buffer_foo()
- * and buffer_foo() functions.
+ * and buffer_foo() functions.  b_state is changed without any lock
+ * held, e.g. on every cache hit, so all of them are atomic: a plain
+ * read-modify-write could lose a concurrent BH_Dirty.
  */
 #define BUFFER_FNS(bit, name)                                                  \
 	static inline void set_buffer_##name(struct buffer_head *bh)           \
 	{                                                                      \
-		set_bit(BH_##bit, &(bh)->b_state);                           \
+		__atomic_fetch_or(&(bh)->b_state, 1UL << BH_##bit,             \
+				  __ATOMIC_SEQ_CST);                           \
 	}                                                                      \
 	static inline void clear_buffer_##name(struct buffer_head *bh)         \
 	{                                                                      \
-		clear_bit(BH_##bit, &(bh)->b_state);                         \
+		__atomic_fetch_and(&(bh)->b_state, ~(1UL << BH_##bit),         \
+				   __ATOMIC_SEQ_CST);                          \
 	}                                                                      \
 	static inline int buffer_##name(const struct buffer_head *bh)          \
 	{                                                                      \
-		return test_bit(BH_##bit, &(bh)->b_state);                     \
+		return (__atomic_load_n(&(bh)->b_state, __ATOMIC_ACQUIRE) >>   \
+			BH_##bit) & 1;                                         \
 	}
 
 /*
@@ -148,11 +268,13 @@ struct buffer_head
 #define TAS_BUFFER_FNS(bit, name)                                              \
 	static inline int test_set_buffer_##name(struct buffer_head *bh)       \
 	{                                                                      \
-		return test_and_set_bit(BH_##bit, &(bh)->b_state);           \
+		return (__atomic_fetch_or(&(bh)->b_state, 1UL << BH_##bit,     \
+					  __ATOMIC_SEQ_CST) >> BH_##bit) & 1;  \
 	}                                                                      \
 	static inline int test_clear_buffer_##name(struct buffer_head *bh)     \
 	{                                                                      \
-		return test_and_clear_bit(BH_##bit, &(bh)->b_state);         \
+		return (__atomic_fetch_and(&(bh)->b_state, ~(1UL << BH_##bit), \
+					   __ATOMIC_SEQ_CST) >> BH_##bit) & 1; \
 	}
 
 /*
@@ -181,6 +303,11 @@ BUFFER_FNS(Write_EIO, write_io_error)
 BUFFER_FNS(Ordered, ordered)
 BUFFER_FNS(Eopnotsupp, eopnotsupp)
 BUFFER_FNS(Unwritten, unwritten)
+BUFFER_FNS(Referenced, referenced)
+TAS_BUFFER_FNS(Referenced, referenced)
+BUFFER_FNS(Hot, hot)
+BUFFER_FNS(Readahead, readahead)
+TAS_BUFFER_FNS(Readahead, readahead)
 
 static inline int trylock_buffer(struct buffer_head *bh)
 {
@@ -221,18 +348,68 @@ static inline struct buffer_head *sb_getblk(struct super_block *super,
 	return __getblk(super->s_bdev, block, super->s_blocksize);
 }
 
-struct block_device *bdev_alloc(int fd, int blocksize_bits);
+struct buffer_head *__getblk_nowait(struct block_device *, uint64_t, int);
+static inline struct buffer_head *sb_getblk_nowait(struct super_block *super,
+						   uint64_t block)
+{
+	return __getblk_nowait(super->s_bdev, block, super->s_blocksize);
+}
+
+struct buffer_head *__getblk_noref(struct block_device *, uint64_t, int);
+static inline struct buffer_head *sb_getblk_noref(struct super_block *super,
+						  uint64_t block)
+{
+	return __getblk_noref(super->s_bdev, block, super->s_blocksize);
+}
+
+/* Default for the cache_size mount option, in bytes */
+#define BH_CACHE_SIZE_DEFAULT (256UL << 20)
+/* The budget never goes below this many buffers */
+#define BH_MIN_BUFFERS 2048
+
+/* Defaults for the dirty_background_ratio, dirty_ratio and dirty_expire
+ * mount options: percentages of the cache budget, and seconds. */
+#define BH_DIRTY_BACKGROUND_RATIO_DEFAULT 10
+#define BH_DIRTY_RATIO_DEFAULT 20
+#define BH_DIRTY_EXPIRE_DEFAULT 30
+
+struct bdev_config {
+	const struct bh_policy *policy;
+	size_t cache_size;                      /* bytes */
+	unsigned int dirty_background_ratio;    /* % of cache_size */
+	unsigned int dirty_ratio;               /* % of cache_size */
+	unsigned int dirty_expire;              /* seconds */
+};
+
+struct block_device *bdev_alloc(int fd, int blocksize_bits,
+				const struct bdev_config *config);
 void bdev_free(struct block_device *bdev);
+void bdev_showstat(struct block_device *bdev);
+void bdev_balance_dirty(struct block_device *bdev);
 struct buffer_head *buffer_alloc(struct block_device *bdev, uint64_t block,
 				 int page_size);
 void brelse(struct buffer_head *bh);
 int bh_submit_read(struct buffer_head *bh);
+void bdev_unplug(struct block_device *bdev);
 void wait_on_buffer(struct buffer_head *bh);
 
+/* Upper bound of buffers read or written with a single syscall */
+#define BH_READ_CONTIG_MAX 128
+#define BH_WRITE_CONTIG_MAX 128
+int bh_read_contig(struct buffer_head **bhs, int nr);
+
 /* bufops.c */
+int fs_cache_set_policy(const char *name);
+void fs_cache_set_size(size_t size);
+int fs_cache_set_dirty(unsigned int background_ratio, unsigned int ratio,
+		       unsigned int expire);
+void fs_balance_dirty(void);
+unsigned int fs_cache_dirty_expire(void);
 int fs_cache_init(void);
 void fs_cache_cleanup(void);
 struct buffer_head *fs_bread(ext4_fsblk_t block, int *ret);
+int fs_bread_blocks(ext4_fsblk_t block, int count, void *buf, int meta);
+int fs_breadahead(ext4_fsblk_t block, int count);
 struct buffer_head *fs_bwrite(ext4_fsblk_t block, int *ret);
 void fs_brelse(struct buffer_head *bh);
 void fs_mark_buffer_dirty(struct buffer_head *bh);
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 
 #include "super.h"
 #include "buffer.h"
@@ -10,16 +12,88 @@ static int fs_bh_alloc = 0;
 static int fs_bh_freed = 0;
 
 static struct block_device *block_device = NULL;
+static struct bdev_config block_device_config = {
+	.policy			= NULL,
+	.cache_size		= BH_CACHE_SIZE_DEFAULT,
+	.dirty_background_ratio	= BH_DIRTY_BACKGROUND_RATIO_DEFAULT,
+	.dirty_ratio		= BH_DIRTY_RATIO_DEFAULT,
+	.dirty_expire		= BH_DIRTY_EXPIRE_DEFAULT,
+};
+
+/*
+ * Select the cache replacement policy by name, before the cache is set
+ * up by fs_cache_init().
+ */
+int fs_cache_set_policy(const char *name)
+{
+	block_device_config.policy = bh_policy_find(name);
+	if (!block_device_config.policy)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Set the memory budget of the cache in bytes, dirty and in use buffers
+ * included.
+ */
+void fs_cache_set_size(size_t size)
+{
+	block_device_config.cache_size = size;
+}
+
+/*
+ * Set the dirty thresholds, in percent of the cache size: writeback
+ * starts above @background_ratio, and writers are throttled above
+ * @ratio.  Buffers dirty for @expire seconds are written back anyway.
+ */
+int fs_cache_set_dirty(unsigned int background_ratio, unsigned int ratio,
+		       unsigned int expire)
+{
+	if (!ratio || ratio > 100 || !background_ratio)
+		return -EINVAL;
+
+	if (background_ratio >= ratio) {
+		WARNING("dirty_background_ratio %u is not below dirty_ratio %u, "
+			"using %u", background_ratio, ratio, ratio / 2);
+		background_ratio = ratio / 2;
+	}
+
+	block_device_config.dirty_background_ratio = background_ratio;
+	block_device_config.dirty_ratio = ratio;
+	block_device_config.dirty_expire = expire;
+	return 0;
+}
+
+/* Seconds after which dirty buffers are written back anyway */
+unsigned int fs_cache_dirty_expire(void)
+{
+	return block_device_config.dirty_expire;
+}
 
 int fs_cache_init(void)
 {
-	block_device = bdev_alloc(disk_get_fd(), super_block_size_bits());
+	if (!block_device_config.policy)
+		block_device_config.policy = bh_policy_find(NULL);
+
+	block_device = bdev_alloc(disk_get_fd(), super_block_size_bits(),
+				  &block_device_config);
 	if (block_device)
 		return 0;
 
 	return -1;
 }
 
+/*
+ * Wait for writeback if too much of the cache is dirty.  Called before
+ * dirtying more buffers, with none held.
+ */
+void fs_balance_dirty(void)
+{
+	assert(block_device);
+	bdev_balance_dirty(block_device);
+}
+
 void fs_cache_cleanup(void)
 {
 	if (block_device)
@@ -38,11 +112,135 @@ struct buffer_head *fs_bread(ext4_fsblk_t block, int *ret)
 	DEBUG("Wait on bh: 0x%p ", bh);
 	wait_on_buffer(bh);
 	if (bh)
-		fs_bh_alloc++;
+		__sync_fetch_and_add(&fs_bh_alloc, 1);
 
 	return bh;
 }
 
+/*
+ * Read @count consecutive blocks starting at @block into @buf.  Blocks
+ * found uptodate in the cache are copied out directly, and each run of
+ * contiguous misses is read from the disk with a single preadv() through
+ * the buffers of the run, which stay cached afterwards.  @meta marks the
+ * buffers as metadata for the cache replacement policy.
+ */
+int fs_bread_blocks(ext4_fsblk_t block, int count, void *buf, int meta)
+{
+	struct buffer_head *bhs[BH_READ_CONTIG_MAX];
+	struct super_block *sb;
+	int i = 0, nr, j, err = 0;
+
+	assert(block_device);
+	sb = block_device->bd_super;
+
+	while (i < count) {
+		struct buffer_head *bh, *hit = NULL;
+
+		/* Gather the run of misses starting at block + i.  Once
+		 * buffers of the run are locked, the run is cut short rather
+		 * than waiting for room in the cache.  The blocks after the
+		 * first are only peeked at, a block cut off is looked up for
+		 * real once the run gets to it. */
+		for (nr = 0; i + nr < count && nr < BH_READ_CONTIG_MAX; nr++) {
+			if (nr)
+				bh = sb_getblk_noref(sb, block + i + nr);
+			else
+				bh = sb_getblk(sb, block + i);
+			if (!bh) {
+				if (!nr)
+					err = -ENOMEM;
+				break;
+			}
+			if (!buffer_uptodate(bh) && trylock_buffer(bh)) {
+				if (!buffer_uptodate(bh)) {
+					bhs[nr] = bh;
+					continue;
+				}
+				unlock_buffer(bh);
+			}
+			if (nr)
+				brelse(bh);
+			else
+				hit = bh;
+			break;
+		}
+
+		if (nr) {
+			int ret = bh_read_contig(bhs, nr);
+			for (j = 0; j < nr; j++) {
+				if (meta)
+					set_buffer_meta(bhs[j]);
+				if (!ret)
+					memcpy(buf + (size_t)(i + j) * sb->s_blocksize,
+					       bhs[j]->b_data, sb->s_blocksize);
+				brelse(bhs[j]);
+			}
+			if (ret)
+				return ret;
+
+			i += nr;
+			continue;
+		}
+		if (err)
+			return err;
+
+		/* A cache hit, or a block somebody else is reading already */
+		bh = hit;
+		err = bh_submit_read(bh);
+		wait_on_buffer(bh);
+		if (err || !buffer_uptodate(bh)) {
+			brelse(bh);
+			return err ? err : -EIO;
+		}
+		if (meta)
+			set_buffer_meta(bh);
+		memcpy(buf + (size_t)i * sb->s_blocksize, bh->b_data,
+		       sb->s_blocksize);
+		brelse(bh);
+		i++;
+	}
+
+	return 0;
+}
+
+/*
+ * Start reading @count blocks from @block into the cache, without
+ * waiting for them.  Blocks cached or under I/O already are skipped.
+ * Rather than waiting for room in the cache, the readahead is cut
+ * short; the number of blocks dealt with is returned.  The blocks read
+ * are only taken as used once something looks them up.
+ */
+int fs_breadahead(ext4_fsblk_t block, int count)
+{
+	struct super_block *sb;
+	int i;
+
+	assert(block_device);
+	sb = block_device->bd_super;
+
+	for (i = 0; i < count; i++) {
+		struct buffer_head *bh = sb_getblk_noref(sb, block + i);
+
+		if (!bh)
+			break;
+		if (!buffer_uptodate(bh) && !buffer_locked(bh)) {
+			set_buffer_readahead(bh);
+			bh_submit_read(bh);
+		}
+		brelse(bh);
+	}
+	bdev_unplug(block_device);
+
+	return i;
+}
+
+/*
+ * Get the buffer of @block to overwrite it, without reading it first.
+ * The buffer is returned locked, which waits for any read still in
+ * flight on it (readahead, say) and keeps new ones from starting.  The
+ * caller unlocks it once the new data is in and marked dirty or
+ * uptodate, so that no read lands on top of it.
+ */
 struct buffer_head *fs_bwrite(ext4_fsblk_t block, int *ret)
 {
 	int err = 0;
@@ -51,15 +249,17 @@ struct buffer_head *fs_bwrite(ext4_fsblk_t block, int *ret)
 	bh = sb_getblk(block_device->bd_super, block);
 	if (ret)
 		*ret = err;
-	if (bh)
-		fs_bh_alloc++;
+	if (bh) {
+		lock_buffer(bh);
+		__sync_fetch_and_add(&fs_bh_alloc, 1);
+	}
 
 	return bh;
 }
 
 void fs_brelse(struct buffer_head *bh)
 {
-	fs_bh_freed++;
+	__sync_fetch_and_add(&fs_bh_freed, 1);
 	brelse(bh);
 }
 
@@ -80,4 +280,9 @@ void fs_bh_showstat(void)
 {
 	printf("fs_bh_alloc: %d, fs_bh_freed: %d\n", fs_bh_alloc,
 		fs_bh_freed);
+	if (block_device)
+		printf("%s: hits: %lu, misses: %lu, evictions: %lu\n",
+			block_device->bd_policy->name,
+			block_device->bd_nr_hits, block_device->bd_nr_misses,
+			block_device->bd_nr_evictions);
 }
@@ -0,0 +1,359 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licens
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-
+ */
+
+/*
+ * Replacement policies for the buffers on the freelist, that is the
+ * buffers which are neither in use nor dirty.  Buffers in use are not
+ * seen by the policy until they are released again.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "logging.h"
+
+/*
+ * lru: buffers are evicted in the order they were released.
+ */
+static int lru_init(struct block_device *bdev, unsigned long capacity)
+{
+	UNUSED(capacity);
+	INIT_LIST_HEAD(&bdev->bd_bh_free);
+	return 0;
+}
+
+static void lru_exit(struct block_device *bdev)
+{
+	UNUSED(bdev);
+}
+
+static void lru_miss(struct block_device *bdev, struct buffer_head *bh)
+{
+	UNUSED(bdev);
+	UNUSED(bh);
+}
+
+static void lru_attach(struct block_device *bdev, struct buffer_head *bh)
+{
+	list_add_tail(&bh->b_freelist, &bdev->bd_bh_free);
+}
+
+static void lru_detach(struct block_device *bdev, struct buffer_head *bh)
+{
+	UNUSED(bdev);
+	list_del_init(&bh->b_freelist);
+}
+
+static struct buffer_head *lru_victim(struct block_device *bdev)
+{
+	if (list_empty(&bdev->bd_bh_free))
+		return NULL;
+	return list_first_entry(&bdev->bd_bh_free,
+				struct buffer_head, b_freelist);
+}
+
+static void lru_showstat(struct block_device *bdev)
+{
+	UNUSED(bdev);
+}
+
+static const struct bh_policy bh_policy_lru = {
+	.name		= "lru",
+	.init		= lru_init,
+	.exit		= lru_exit,
+	.miss		= lru_miss,
+	.attach		= lru_attach,
+	.detach		= lru_detach,
+	.victim		= lru_victim,
+	.evict		= lru_detach,
+	.showstat	= lru_showstat,
+};
+
+/*
+ * arc: Adaptive Replacement Cache (Megiddo & Modha).  Buffers released
+ * for the first time go to T1, buffers that were looked up again while
+ * cached, or that were evicted recently (B1 and B2 remember the block
+ * numbers of the last evictions), go to T2.  The target size p of T1
+ * adapts to hits in the ghost lists, so a single sequential scan can
+ * only ever push out T1, and the working set in T2 survives it.
+ *
+ * Metadata buffers go straight to T2.
+ */
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_NR_LISTS };
+
+struct arc_ghost {
+	uint64_t ag_blocknr;
+	int ag_list;
+	struct list_head ag_lru;
+	struct arc_ghost *ag_next;	/* hash chain */
+};
+
+struct arc {
+	unsigned long a_c;		/* capacity */
+	unsigned long a_p;		/* target size of T1 */
+	unsigned long a_nr[ARC_NR_LISTS];
+	struct list_head a_list[ARC_NR_LISTS];
+
+	struct arc_ghost **a_hash;
+	unsigned long a_hash_mask;
+
+	unsigned long a_ghost_hits[2];	/* in B1 and B2 */
+};
+
+static inline struct arc *bdev_arc(struct block_device *bdev)
+{
+	return bdev->bd_policy_data;
+}
+
+static inline unsigned long arc_hash(struct arc *arc, uint64_t blocknr)
+{
+	return (blocknr * 0x9E3779B97F4A7C15ULL >> 32) & arc->a_hash_mask;
+}
+
+static struct arc_ghost *arc_ghost_find(struct arc *arc, uint64_t blocknr)
+{
+	struct arc_ghost *g = arc->a_hash[arc_hash(arc, blocknr)];
+
+	while (g && g->ag_blocknr != blocknr)
+		g = g->ag_next;
+	return g;
+}
+
+static void arc_ghost_del(struct arc *arc, struct arc_ghost *g)
+{
+	struct arc_ghost **pg = &arc->a_hash[arc_hash(arc, g->ag_blocknr)];
+
+	while (*pg != g)
+		pg = &(*pg)->ag_next;
+	*pg = g->ag_next;
+
+	list_del(&g->ag_lru);
+	arc->a_nr[g->ag_list]--;
+}
+
+static void arc_ghost_add(struct arc *arc, struct arc_ghost *g,
+			  uint64_t blocknr, int list)
+{
+	unsigned long h = arc_hash(arc, blocknr);
+
+	g->ag_blocknr = blocknr;
+	g->ag_list = list;
+	g->ag_next = arc->a_hash[h];
+	arc->a_hash[h] = g;
+
+	list_add_tail(&g->ag_lru, &arc->a_list[list]);
+	arc->a_nr[list]++;
+}
+
+/*
+ * Trim the ghost lists to make room for one more entry on @list: T1
+ * and B1 together hold at most c entries, and all four lists together
+ * at most 2c.  The last ghost dropped is returned for reuse.
+ */
+static struct arc_ghost *arc_ghost_trim(struct arc *arc, int list)
+{
+	unsigned long *nr = arc->a_nr;
+	struct arc_ghost *g = NULL;
+
+	for (;;) {
+		int victim;
+
+		if (list == ARC_B1 && nr[ARC_B1] &&
+		    nr[ARC_T1] + nr[ARC_B1] + 1 > arc->a_c)
+			victim = ARC_B1;
+		else if (nr[ARC_B1] + nr[ARC_B2] &&
+			 nr[ARC_T1] + nr[ARC_T2] + nr[ARC_B1] + nr[ARC_B2] + 1 >
+			 2 * arc->a_c)
+			victim = nr[ARC_B2] ? ARC_B2 : ARC_B1;
+		else
+			break;
+
+		free(g);
+		g = list_first_entry(&arc->a_list[victim],
+				     struct arc_ghost, ag_lru);
+		arc_ghost_del(arc, g);
+	}
+
+	return g;
+}
+
+static int arc_init(struct block_device *bdev, unsigned long capacity)
+{
+	unsigned long buckets = 1;
+	struct arc *arc;
+	int i;
+
+	arc = calloc(1, sizeof(struct arc));
+	if (!arc)
+		return -ENOMEM;
+
+	while (buckets < capacity)
+		buckets <<= 1;
+	arc->a_hash = calloc(buckets, sizeof(struct arc_ghost *));
+	if (!arc->a_hash) {
+		free(arc);
+		return -ENOMEM;
+	}
+	arc->a_hash_mask = buckets - 1;
+	arc->a_c = capacity;
+
+	for (i = 0; i < ARC_NR_LISTS; i++)
+		INIT_LIST_HEAD(&arc->a_list[i]);
+
+	bdev->bd_policy_data = arc;
+	return 0;
+}
+
+static void arc_exit(struct block_device *bdev)
+{
+	struct arc *arc = bdev_arc(bdev);
+	struct arc_ghost *g, *tmp;
+	int i;
+
+	for (i = ARC_B1; i <= ARC_B2; i++)
+		list_for_each_entry_safe(g, tmp, &arc->a_list[i], ag_lru)
+			free(g);
+
+	free(arc->a_hash);
+	free(arc);
+	bdev->bd_policy_data = NULL;
+}
+
+static void arc_miss(struct block_device *bdev, struct buffer_head *bh)
+{
+	struct arc *arc = bdev_arc(bdev);
+	unsigned long *nr = arc->a_nr;
+	struct arc_ghost *g;
+	unsigned long delta;
+
+	g = arc_ghost_find(arc, bh->b_blocknr);
+	if (!g)
+		return;
+
+	/* Evicted too early from T1: let T1 grow, from T2: let T2 grow. */
+	if (g->ag_list == ARC_B1) {
+		delta = MAX(nr[ARC_B2] / nr[ARC_B1], 1UL);
+		arc->a_p = MIN(arc->a_p + delta, arc->a_c);
+		arc->a_ghost_hits[0]++;
+	} else {
+		delta = MAX(nr[ARC_B1] / nr[ARC_B2], 1UL);
+		arc->a_p = arc->a_p > delta ? arc->a_p - delta : 0;
+		arc->a_ghost_hits[1]++;
+	}
+
+	arc_ghost_del(arc, g);
+	free(g);
+	set_buffer_hot(bh);
+}
+
+static void arc_attach(struct block_device *bdev, struct buffer_head *bh)
+{
+	struct arc *arc = bdev_arc(bdev);
+	int list;
+
+	if (test_clear_buffer_referenced(bh) || buffer_meta(bh))
+		set_buffer_hot(bh);
+
+	list = buffer_hot(bh) ? ARC_T2 : ARC_T1;
+	list_add_tail(&bh->b_freelist, &arc->a_list[list]);
+	arc->a_nr[list]++;
+}
+
+static void arc_detach(struct block_device *bdev, struct buffer_head *bh)
+{
+	struct arc *arc = bdev_arc(bdev);
+
+	list_del_init(&bh->b_freelist);
+	arc->a_nr[buffer_hot(bh) ? ARC_T2 : ARC_T1]--;
+}
+
+static struct buffer_head *arc_victim(struct block_device *bdev)
+{
+	struct arc *arc = bdev_arc(bdev);
+	int list;
+
+	if (arc->a_nr[ARC_T1] &&
+	    (arc->a_nr[ARC_T1] > arc->a_p || !arc->a_nr[ARC_T2]))
+		list = ARC_T1;
+	else if (arc->a_nr[ARC_T2])
+		list = ARC_T2;
+	else
+		return NULL;
+
+	return list_first_entry(&arc->a_list[list],
+				struct buffer_head, b_freelist);
+}
+
+static void arc_evict(struct block_device *bdev, struct buffer_head *bh)
+{
+	struct arc *arc = bdev_arc(bdev);
+	int list = buffer_hot(bh) ? ARC_B2 : ARC_B1;
+	struct arc_ghost *g;
+
+	arc_detach(bdev, bh);
+	clear_buffer_hot(bh);
+
+	g = arc_ghost_trim(arc, list);
+	if (!g)
+		g = malloc(sizeof(struct arc_ghost));
+	if (g)
+		arc_ghost_add(arc, g, bh->b_blocknr, list);
+}
+
+static void arc_showstat(struct block_device *bdev)
+{
+	struct arc *arc = bdev_arc(bdev);
+
+	INFO("arc: p %lu/%lu, T1 %lu, T2 %lu, B1 %lu (%lu hits), B2 %lu (%lu hits)",
+	     arc->a_p, arc->a_c, arc->a_nr[ARC_T1], arc->a_nr[ARC_T2],
+	     arc->a_nr[ARC_B1], arc->a_ghost_hits[0],
+	     arc->a_nr[ARC_B2], arc->a_ghost_hits[1]);
+}
+
+static const struct bh_policy bh_policy_arc = {
+	.name		= "arc",
+	.init		= arc_init,
+	.exit		= arc_exit,
+	.miss		= arc_miss,
+	.attach		= arc_attach,
+	.detach		= arc_detach,
+	.victim		= arc_victim,
+	.evict		= arc_evict,
+	.showstat	= arc_showstat,
+};
+
+static const struct bh_policy *bh_policies[] = {
+	&bh_policy_arc,		/* the default */
+	&bh_policy_lru,
+	NULL
+};
+
+/*
+ * Look a policy up by name, NULL gives the default one.
+ */
+const struct bh_policy *bh_policy_find(const char *name)
+{
+	int i;
+
+	if (!name)
+		return bh_policies[0];
+
+	for (i = 0; bh_policies[i]; i++)
+		if (!strcmp(bh_policies[i]->name, name))
+			return bh_policies[i];
+
+	return NULL;
+}
@@ -15,6 +15,11 @@
     typeof (y) __y = (y);               \
     __x < __y ? __x : __y;              \
 })
+#define MAX(x, y)   ({                  \
+    typeof (x) __x = (x);               \
+    typeof (y) __y = (y);               \
+    __x > __y ? __x : __y;              \
+})
 
 #define STATIC_ASSERT(e) static char const static_assert[(e) ? 1 : -1] = {'!'}
 
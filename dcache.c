@@ -8,21 +8,44 @@
  */
 
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "types/e4f_dcache.h"
+#include "types/ext4_dentry.h"
+#include "common.h"
+#include "dcache.h"
 #include "logging.h"
 
-#define DCACHE_ENTRY_CALLOC()   calloc(1, sizeof(struct dcache_entry))
 #define DCACHE_ENTRY_LIFE       8
 
+#define DCACHE_HASH_BITS        16
+#define DCACHE_HASH_SIZE        (1 << DCACHE_HASH_BITS)
+#define DCACHE_LOCKS            64
+#define DCACHE_SLAB_ENTRIES     63
+#define DCACHE_MIN_ENTRIES      1024
 
-/* Locking for the dcache is tricky.  What we try to do is to keep insertions
- * and lookups threadsafe by atomic updates.  That keeps the tree safe, but
- * means that eventually there might be duplicated entries.
- * However, when entry pruning is implemented, there might be a need to take
- * real locks into use.
+
+/* The dcache is one hash table, indexed by the inode number of the directory
+ * and a hash of the name, so that a lookup costs the same however many names
+ * of a directory are cached.  The buckets are protected by DCACHE_LOCKS
+ * read-write locks, bucket i by lock i % DCACHE_LOCKS: lookups only take it
+ * shared and never return entries, just the inode number found.  Entries are
+ * carved out of slabs, which are never given back before dcache_uninit().
+ *
+ * The number of entries is bounded by the size set with dcache_set_size(),
+ * long names being charged as the number of entries they take up as well.
+ * Past it, dcache_prune() sweeps the buckets like a clock hand: lru_count is
+ * decremented for every entry it passes, and entries found at zero are
+ * evicted.  Entries start with a lru_count of 1 and get DCACHE_ENTRY_LIFE
+ * whenever they are looked up, so names seen once go first.  As entries refer
+ * to their parent by inode number only, any of them can be evicted.
+ *
+ * Names known not to exist are cached as well, as negative entries with an
+ * inode number of 0.  Whoever creates a name has to dcache_insert() it, which
+ * turns the negative entry into a positive one.
  *
  * About string handling in this file, it should be said that all strings are
  * provided with a length.  The idea is that usually strings are passed here as
@@ -31,98 +54,303 @@
  * so we just take it from whoever calls us.
  * All this hassle is basically to avoid copying around strings. */
 
+struct dcache_slab {
+    struct dcache_entry entries[DCACHE_SLAB_ENTRIES];
+    struct dcache_slab *next;
+};
+
+static struct dcache_entry *dcache_hash[DCACHE_HASH_SIZE];
+static pthread_rwlock_t dcache_locks[DCACHE_LOCKS];
+static int dcache_initialized;
+
+static pthread_mutex_t dcache_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dcache_slab *dcache_slabs;
+static struct dcache_entry *dcache_free_entries;
 
-static struct dcache_entry root;
+static pthread_mutex_t dcache_prune_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t dcache_clock_hand;
 
+static unsigned long dcache_max_entries = DCACHE_SIZE_DEFAULT / sizeof(struct dcache_entry);
+static unsigned long dcache_nr_entries;     /* long names included */
+static unsigned long dcache_nr_hits;
+static unsigned long dcache_nr_negative;
+static unsigned long dcache_nr_misses;
+static unsigned long dcache_nr_evictions;
 
-int dcache_init_root(uint32_t n)
+/* Sets the memory budget of the dcache in bytes.  Called before dcache_init() */
+void dcache_set_size(size_t size)
 {
-    if (root.inode) {
+    dcache_max_entries = MAX(size / sizeof(struct dcache_entry),
+                             (size_t)DCACHE_MIN_ENTRIES);
+}
+
+int dcache_init(void)
+{
+    if (dcache_initialized) {
         WARNING("Reinitializing dcache not allowed.  Skipped.");
         return -1;
     }
 
-    /* Root entry doesn't need most of the fields.  Namely, it only uses the
-     * inode field and the childs pointer. */
-    INFO("Initializing root dcache entry");
-    root.inode = n;
-    root.childs = NULL;
+    INFO("Initializing dcache");
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_rwlock_init(&dcache_locks[i], NULL);
+    }
+    dcache_initialized = 1;
 
     return 0;
 }
 
-/* Inserts a node as a childs of a given parent.  The parent is updated to
- * point the newly inserted childs as the first childs.  We return the new
- * entry so that further entries can be inserted.
- *
- *      [0]                  [0]
- *       /        ==>          \
- *      /         ==>           \
- * .->[1]->[2]-.       .->[1]->[3]->[2]-.
- * `-----------´       `----------------´
-*/
-struct dcache_entry *dcache_insert(struct dcache_entry *parent, const char *name, int namelen, uint32_t n)
+static void dcache_showstat(void)
 {
-    DEBUG("Inserting %s,%d to dcache", name, namelen);
+    unsigned long lookups = dcache_nr_hits + dcache_nr_misses;
 
-    /* TODO: Deal with names that exceed the allocated size */
-    if (namelen + 1 > DCACHE_ENTRY_NAME_LEN) return NULL;
+    INFO("dcache: %lu hits (%lu negative), %lu misses (%lu%% hit rate), "
+         "%lu evictions, %lu/%lu entries",
+         dcache_nr_hits, dcache_nr_negative, dcache_nr_misses,
+         lookups ? dcache_nr_hits * 100 / lookups : 0,
+         dcache_nr_evictions, dcache_nr_entries, dcache_max_entries);
+}
+
+void dcache_uninit(void)
+{
+    dcache_showstat();
 
-    if (parent == NULL) {
-        parent = &root;
-        ASSERT(parent->inode);
+    for (int i = 0; i < DCACHE_HASH_SIZE; i++) {
+        for (struct dcache_entry *iter = dcache_hash[i]; iter; iter = iter->next) {
+            if (dcache_entry_name_is_long(iter)) free(iter->long_name);
+        }
     }
 
-    struct dcache_entry *new_entry = DCACHE_ENTRY_CALLOC();
-    strncpy(new_entry->name, name, namelen);
-    new_entry->name[namelen] = 0;
-    new_entry->inode = n;
+    while (dcache_slabs) {
+        struct dcache_slab *next = dcache_slabs->next;
 
-    if (!parent->childs) {
-        new_entry->siblings = new_entry;
-        parent->childs = new_entry;
-    } else {
-        new_entry->siblings = parent->childs->siblings;
-        parent->childs->siblings = new_entry;
-        parent->childs = new_entry;
+        free(dcache_slabs);
+        dcache_slabs = next;
     }
+    dcache_free_entries = NULL;
+    dcache_nr_entries = 0;
+    memset(dcache_hash, 0, sizeof(dcache_hash));
 
-    return new_entry;
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_rwlock_destroy(&dcache_locks[i]);
+    }
+    dcache_initialized = 0;
 }
 
-/* Lookup a cache entry for a given file name.  Return value is a struct pointer
- * that can be used to both obtain the inode number and insert further child
- * entries. */
-/* TODO: Prune entries by using the LRU counter */
-struct dcache_entry *dcache_lookup(struct dcache_entry *parent, const char *name, int namelen)
+/* FNV-1a */
+static uint32_t dcache_name_hash(const char *name, int namelen)
 {
-    if (parent == NULL) {
-        parent = &root;
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < namelen; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619;
     }
 
-    if (!parent->childs) {
-        DEBUG("Looking up %s,%d: Not found (no childs)", name, namelen);
-        return NULL;
+    return hash;
+}
+
+static inline uint32_t dcache_bucket(uint32_t parent, uint32_t hash)
+{
+    return ((hash ^ parent) * 0x9e3779b1u) >> (32 - DCACHE_HASH_BITS);
+}
+
+/* In entries, what an entry for a name of namelen bytes takes up */
+static inline unsigned long dcache_entry_charge(int namelen)
+{
+    if (namelen < DCACHE_ENTRY_NAME_LEN) return 1;
+    return 1 + (namelen + sizeof(struct dcache_entry)) / sizeof(struct dcache_entry);
+}
+
+static inline pthread_rwlock_t *dcache_bucket_lock(uint32_t bucket)
+{
+    return &dcache_locks[bucket % DCACHE_LOCKS];
+}
+
+static struct dcache_entry *dcache_entry_alloc(void)
+{
+    struct dcache_entry *entry;
+
+    pthread_mutex_lock(&dcache_slab_lock);
+    if (!dcache_free_entries) {
+        struct dcache_slab *slab;
+
+        if (posix_memalign((void **)&slab, sizeof(struct dcache_entry),
+                           sizeof(struct dcache_slab))) {
+            pthread_mutex_unlock(&dcache_slab_lock);
+            return NULL;
+        }
+
+        for (int i = 0; i < DCACHE_SLAB_ENTRIES; i++) {
+            slab->entries[i].next = dcache_free_entries;
+            dcache_free_entries = &slab->entries[i];
+        }
+        slab->next = dcache_slabs;
+        dcache_slabs = slab;
     }
 
-    /* Iterate the list of siblings to see if there is any match */
-    struct dcache_entry *iter = parent->childs;
-    do {
-        if (strncmp(iter->name, name, namelen) == 0 && iter->name[namelen] == 0) {
-            parent->childs = iter;
-            DEBUG("Looking up %s,%d: Found", name, namelen);
-            return iter;
+    entry = dcache_free_entries;
+    dcache_free_entries = entry->next;
+    pthread_mutex_unlock(&dcache_slab_lock);
+
+    return entry;
+}
+
+/* Gives back a list of entries chained through next */
+static void dcache_entries_free(struct dcache_entry *entries)
+{
+    pthread_mutex_lock(&dcache_slab_lock);
+    while (entries) {
+        struct dcache_entry *next = entries->next;
+
+        if (dcache_entry_name_is_long(entries)) free(entries->long_name);
+        entries->next = dcache_free_entries;
+        dcache_free_entries = entries;
+        entries = next;
+    }
+    pthread_mutex_unlock(&dcache_slab_lock);
+}
+
+/* Evicts entries until the dcache is some way below its budget again.  If
+ * somebody else is at it already, we don't wait for them. */
+static void dcache_prune(void)
+{
+    unsigned long target = dcache_max_entries - dcache_max_entries / 64;
+    unsigned long sweep_left = (unsigned long)DCACHE_HASH_SIZE * (DCACHE_ENTRY_LIFE + 1);
+    struct dcache_entry *victims = NULL;
+
+    if (pthread_mutex_trylock(&dcache_prune_lock)) return;
+
+    while (dcache_nr_entries > target && sweep_left--) {
+        uint32_t bucket = dcache_clock_hand++ & (DCACHE_HASH_SIZE - 1);
+        struct dcache_entry **pprev = &dcache_hash[bucket];
+
+        pthread_rwlock_wrlock(dcache_bucket_lock(bucket));
+        while (*pprev) {
+            struct dcache_entry *entry = *pprev;
+
+            if (entry->lru_count) {
+                entry->lru_count--;
+                pprev = &entry->next;
+                continue;
+            }
+
+            *pprev = entry->next;
+            entry->next = victims;
+            victims = entry;
+            __sync_fetch_and_sub(&dcache_nr_entries, dcache_entry_charge(entry->name_len));
+            __sync_fetch_and_add(&dcache_nr_evictions, 1);
         }
+        pthread_rwlock_unlock(dcache_bucket_lock(bucket));
+    }
+    pthread_mutex_unlock(&dcache_prune_lock);
 
-        iter = iter->siblings;
-    } while (iter != parent->childs);
+    dcache_entries_free(victims);
+}
+
+/* Called with the bucket lock held */
+static struct dcache_entry *__dcache_find(uint32_t bucket, uint32_t parent,
+                                          uint32_t hash, const char *name,
+                                          int namelen)
+{
+    for (struct dcache_entry *iter = dcache_hash[bucket]; iter; iter = iter->next) {
+        if (iter->parent == parent && iter->hash == hash &&
+            iter->name_len == namelen &&
+            memcmp(dcache_entry_name(iter), name, namelen) == 0) {
+            return iter;
+        }
+    }
 
-    DEBUG("Looking up %s,%d: Not found", name, namelen);
     return NULL;
 }
 
-uint32_t dcache_get_inode(struct dcache_entry *entry)
+/* Caches that name in the directory parent refers to inode n, of type
+ * file_type, or that it doesn't exist if n is 0.  If the name is cached
+ * already, its inode is updated. */
+int dcache_insert(uint32_t parent, const char *name, int namelen, uint32_t n,
+                  uint8_t file_type)
 {
-    if (entry) return entry->inode;
-    else return root.inode;
+    uint32_t hash = dcache_name_hash(name, namelen);
+    uint32_t bucket = dcache_bucket(parent, hash);
+    struct dcache_entry *new_entry, *entry;
+
+    DEBUG("Inserting %.*s,%d to dcache", namelen, name, namelen);
+
+    if (namelen > EXT4_NAME_LEN) return -ENAMETOOLONG;
+
+    new_entry = dcache_entry_alloc();
+    if (!new_entry) return -ENOMEM;
+
+    char *new_name = new_entry->name;
+    if (namelen >= DCACHE_ENTRY_NAME_LEN) {
+        new_name = malloc(namelen + 1);
+        if (!new_name) {
+            new_entry->name_len = 0;
+            new_entry->next = NULL;
+            dcache_entries_free(new_entry);
+            return -ENOMEM;
+        }
+        new_entry->long_name = new_name;
+    }
+    memcpy(new_name, name, namelen);
+    new_name[namelen] = 0;
+    new_entry->name_len = namelen;
+    new_entry->parent = parent;
+    new_entry->inode = n;
+    new_entry->hash = hash;
+    new_entry->lru_count = 1;
+    new_entry->file_type = file_type;
+
+    pthread_rwlock_wrlock(dcache_bucket_lock(bucket));
+    entry = __dcache_find(bucket, parent, hash, name, namelen);
+    if (entry) {
+        entry->inode = n;
+        entry->file_type = file_type;
+    } else {
+        new_entry->next = dcache_hash[bucket];
+        dcache_hash[bucket] = new_entry;
+    }
+    pthread_rwlock_unlock(dcache_bucket_lock(bucket));
+
+    if (entry) {
+        new_entry->next = NULL;
+        dcache_entries_free(new_entry);
+    } else if (__sync_add_and_fetch(&dcache_nr_entries, dcache_entry_charge(namelen)) >
+               dcache_max_entries) {
+        dcache_prune();
+    }
+    return 0;
+}
+
+/* Lookup the inode number a file name in the directory parent refers to.
+ * Returns 0 if the name is not cached, otherwise 1 with the inode number in n,
+ * which is 0 for a name that doesn't exist, and the type in file_type unless
+ * it is NULL. */
+int dcache_lookup(uint32_t parent, const char *name, int namelen, uint32_t *n,
+                  uint8_t *file_type)
+{
+    uint32_t hash = dcache_name_hash(name, namelen);
+    uint32_t bucket = dcache_bucket(parent, hash);
+    struct dcache_entry *entry;
+
+    pthread_rwlock_rdlock(dcache_bucket_lock(bucket));
+    entry = __dcache_find(bucket, parent, hash, name, namelen);
+    if (entry) {
+        *n = entry->inode;
+        if (file_type) *file_type = entry->file_type;
+        /* Racy, but all writers under the shared lock store the same value */
+        if (entry->lru_count != DCACHE_ENTRY_LIFE) entry->lru_count = DCACHE_ENTRY_LIFE;
+    }
+    pthread_rwlock_unlock(dcache_bucket_lock(bucket));
+
+    if (!entry) {
+        __sync_fetch_and_add(&dcache_nr_misses, 1);
+        DEBUG("Looking up %.*s,%d: Not found", namelen, name, namelen);
+        return 0;
+    }
+
+    __sync_fetch_and_add(&dcache_nr_hits, 1);
+    if (!*n) __sync_fetch_and_add(&dcache_nr_negative, 1);
+    DEBUG("Looking up %.*s,%d: Found%s", namelen, name, namelen, *n ? "" : " (negative)");
+    return 1;
 }
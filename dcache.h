@@ -1,12 +1,18 @@
 #ifndef DCACHE_H
 #define DCACHE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
-struct dcache_entry;
-struct dcache_entry *dcache_insert(struct dcache_entry *parent, const char *name, int namelen, uint32_t n);
-struct dcache_entry *dcache_lookup(struct dcache_entry *parent, const char *name, int namelen);
-uint32_t dcache_get_inode(struct dcache_entry *entry);
-int dcache_init_root(uint32_t n);
+/* Default memory budget of the dcache */
+#define DCACHE_SIZE_DEFAULT     (16UL << 20)
+
+int dcache_insert(uint32_t parent, const char *name, int namelen, uint32_t n,
+                  uint8_t file_type);
+int dcache_lookup(uint32_t parent, const char *name, int namelen, uint32_t *n,
+                  uint8_t *file_type);
+void dcache_set_size(size_t size);
+int dcache_init(void);
+void dcache_uninit(void);
 
 #endif
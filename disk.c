@@ -28,7 +28,8 @@
 static int disk_fd = -1;
 
 
-static int pread_buffered(void *p, size_t size, off_t where)
+/* @meta marks the buffers read as filesystem metadata, see BH_Meta */
+static int pread_buffered(void *p, size_t size, off_t where, int meta)
 {
     /* FreeBSD needs to read aligned whole blocks.
      * TODO: Check what is a safe block size.
@@ -44,6 +45,7 @@ static int pread_buffered(void *p, size_t size, off_t where)
          * case first_offset is the offset into the block. */
         bh = fs_bread((where - first_offset) / PREAD_BLOCK_SIZE, &bread_ret);
         if (!bh) return bread_ret;
+        if (meta) set_buffer_meta(bh);
 
         size_t first_size = MIN(size, (size_t)(PREAD_BLOCK_SIZE - first_offset));
         memcpy(p, bh->b_data + first_offset, first_size);
@@ -61,17 +63,16 @@ static int pread_buffered(void *p, size_t size, off_t where)
 
     size_t mid_read_size = (size / PREAD_BLOCK_SIZE) * PREAD_BLOCK_SIZE;
     if (mid_read_size) {
-        bh = fs_bread(where / PREAD_BLOCK_SIZE, &bread_ret);
-        if (!bh) return bread_ret;
+        /* Cached blocks are copied, contiguous misses are read at once */
+        bread_ret = fs_bread_blocks(where / PREAD_BLOCK_SIZE,
+                                    mid_read_size / PREAD_BLOCK_SIZE, p, meta);
+        if (bread_ret < 0) return bread_ret;
 
-        memcpy(p, bh->b_data, mid_read_size);
         p += mid_read_size;
         size -= mid_read_size;
         where += mid_read_size;
         ret += mid_read_size;
 
-        fs_brelse(bh);
-
         if (!size) return ret;
     }
 
@@ -79,6 +80,7 @@ static int pread_buffered(void *p, size_t size, off_t where)
 
     bh = fs_bread(where / PREAD_BLOCK_SIZE, &bread_ret);
     if (!bh) return bread_ret;
+    if (meta) set_buffer_meta(bh);
 
     memcpy(p, bh->b_data, size);
     fs_brelse(bh);
@@ -120,17 +122,20 @@ static int pwrite_buffered(const void *p, size_t size, off_t where)
     ASSERT(where % PREAD_BLOCK_SIZE == 0);
 
     size_t mid_write_size = (size / PREAD_BLOCK_SIZE) * PREAD_BLOCK_SIZE;
-    if (mid_write_size) {
+    while (mid_write_size) {
         bh = fs_bwrite(where / PREAD_BLOCK_SIZE, &pwrite_ret);
         if (!bh) return pwrite_ret;
 
-        memcpy(bh->b_data, p, mid_write_size);
-        p += mid_write_size;
-        size -= mid_write_size;
-        where += mid_write_size;
-        ret += mid_write_size;
+        memcpy(bh->b_data, p, PREAD_BLOCK_SIZE);
+        p += PREAD_BLOCK_SIZE;
+        size -= PREAD_BLOCK_SIZE;
+        where += PREAD_BLOCK_SIZE;
+        ret += PREAD_BLOCK_SIZE;
+        mid_write_size -= PREAD_BLOCK_SIZE;
 
+        /* fs_bwrite() returned it locked */
         fs_mark_buffer_dirty(bh);
+        unlock_buffer(bh);
         fs_brelse(bh);
 
         if (!size) return ret;
@@ -163,17 +168,17 @@ int disk_get_fd()
     return disk_fd;
 }
 
-int __disk_read(off_t where, size_t size, void *p, const char *func, int line)
+static int disk_read_buffered(off_t where, size_t size, void *p, int meta,
+                              const char *func, int line)
 {
-    static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
     ssize_t pread_ret;
 
     ASSERT(disk_fd >= 0);
 
-    pthread_mutex_lock(&read_lock);
+    /* No lock here: concurrent readers are serialized per block by the
+     * buffer cache (see __getblk() and bh_submit_read()). */
     DEBUG("Disk Read: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
-    pread_ret = pread_buffered(p, size, where);
-    pthread_mutex_unlock(&read_lock);
+    pread_ret = pread_buffered(p, size, where, meta);
     if (size == 0) WARNING("Read operation with 0 size");
 
     ASSERT((size_t)pread_ret == size);
@@ -181,6 +186,16 @@ int __disk_read(off_t where, size_t size, void *p, const char *func, int line)
     return pread_ret;
 }
 
+int __disk_read(off_t where, size_t size, void *p, const char *func, int line)
+{
+    return disk_read_buffered(where, size, p, 0, func, line);
+}
+
+int __disk_read_meta(off_t where, size_t size, void *p, const char *func, int line)
+{
+    return disk_read_buffered(where, size, p, 1, func, line);
+}
+
 int __disk_write(off_t where, size_t size, const void *p, const char *func, int line)
 {
     static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -11,12 +11,15 @@
 #define disk_read(__where, __s, __p)        __disk_read(__where, __s, __p, __func__, __LINE__)
 #define disk_write(__where, __s, __p)        __disk_write(__where, __s, __p, __func__, __LINE__)
 #define disk_read_block(__blocks, __p)      __disk_read(BLOCKS2BYTES(__blocks), BLOCK_SIZE, __p, __func__, __LINE__)
+#define disk_read_meta(__where, __s, __p)   __disk_read_meta(__where, __s, __p, __func__, __LINE__)
+#define disk_read_block_meta(__blocks, __p) __disk_read_meta(BLOCKS2BYTES(__blocks), BLOCK_SIZE, __p, __func__, __LINE__)
 #define disk_write_block(__blocks, __p)      __disk_write(BLOCKS2BYTES(__blocks), BLOCK_SIZE, __p, __func__, __LINE__)
 #define disk_ctx_read(__ctx, __s, __p)      __disk_ctx_read(__ctx, __s, __p, __func__, __LINE__)
 #define disk_ctx_write(__ctx, __s, __p)      __disk_ctx_write(__ctx, __s, __p, __func__, __LINE__)
+/* Typed reads are lookups in on-disk structures, so they count as metadata */
 #define disk_read_type(__where, __t)        ({                                          \
     __t ret;                                                                            \
-    ASSERT(__disk_read(__where, sizeof(__t), &ret, __func__, __LINE__) == sizeof(__t)); \
+    ASSERT(__disk_read_meta(__where, sizeof(__t), &ret, __func__, __LINE__) == sizeof(__t)); \
     ret;                                                                                \
 })
 #define disk_write_type(__where, __t)        ({                                          \
@@ -38,6 +41,7 @@ int pread_wrapper(int disk_fd, void *p, size_t size, off_t where);
 int disk_open(const char *path);
 int disk_get_fd();
 int __disk_read(off_t where, size_t size, void *p, const char *func, int line);
+int __disk_read_meta(off_t where, size_t size, void *p, const char *func, int line);
 int __disk_write(off_t where, size_t size, const void *p, const char *func, int line);
 
 int disk_ctx_create(struct disk_ctx *ctx, off_t where, size_t size, uint32_t len);
@@ -3,6 +3,7 @@
 #include <memory.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "extents.h"
 #include "../alloc.h"
@@ -287,6 +288,7 @@ read_extent_tree_block(struct inode *inode, ext4_fsblk_t pblk, int depth,
 		err = -ENOMEM;
 		goto errout;
 	}
+	set_buffer_meta(bh);
 
 	if (buffer_verified(bh))
 		goto out;
@@ -444,6 +446,145 @@ err:
 	return ret;
 }
 
+/*
+ * Each thread keeps the path of its last lookup, buffers referenced, for
+ * as long as the extents of the inode stay the same.  Blocks mapped by
+ * the same leaf are then found without descending the tree, and the path
+ * itself is reused instead of being allocated for every lookup.
+ */
+struct ext4_ext_path_cache {
+	struct inode *pc_inode;
+	unsigned long pc_gen;
+	struct ext4_ext_path *pc_path;
+};
+
+static pthread_key_t ext_path_cache_key;
+static pthread_once_t ext_path_cache_once = PTHREAD_ONCE_INIT;
+static __thread struct ext4_ext_path_cache *ext_path_cache;
+
+static void ext4_ext_path_cache_free(void *data)
+{
+	struct ext4_ext_path_cache *pc = data;
+
+	if (pc->pc_path) {
+		ext4_ext_drop_refs(pc->pc_path, 0);
+		kfree(pc->pc_path);
+	}
+	free(pc);
+}
+
+static void ext4_ext_path_cache_key_init(void)
+{
+	pthread_key_create(&ext_path_cache_key, ext4_ext_path_cache_free);
+}
+
+static struct ext4_ext_path_cache *ext4_ext_path_cache_get(void)
+{
+	struct ext4_ext_path_cache *pc = ext_path_cache;
+
+	if (pc)
+		return pc;
+
+	pthread_once(&ext_path_cache_once, ext4_ext_path_cache_key_init);
+	pc = calloc(1, sizeof(*pc));
+	if (!pc)
+		return NULL;
+	/* account possible depth increase */
+	pc->pc_path = kzalloc(sizeof(struct ext4_ext_path) *
+			      (EXT4_MAX_EXTENT_DEPTH + 1), GFP_NOFS);
+	if (pc->pc_path)
+		pc->pc_path[0].p_maxdepth = EXT4_MAX_EXTENT_DEPTH;
+	pthread_setspecific(ext_path_cache_key, pc);
+
+	return ext_path_cache = pc;
+}
+
+/*
+ * Whether the leaf @path leads to is the one ext4_find_extent() would
+ * find for @block: the index followed at every level must cover it.
+ */
+static int ext4_ext_path_covers(struct ext4_ext_path *path, ext4_lblk_t block)
+{
+	int i;
+
+	for (i = 0; i < path->p_depth; i++) {
+		struct ext4_extent_idx *ix = path[i].p_idx;
+
+		if (ix != EXT_FIRST_INDEX(path[i].p_hdr) &&
+		    block < le32_to_cpu(ix->ei_block))
+			return 0;
+		if (ix != EXT_LAST_INDEX(path[i].p_hdr) &&
+		    block >= le32_to_cpu(ix[1].ei_block))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * ext4_find_extent() for @block, starting from the path this thread
+ * looked up last.  The path is the caller's until handed back with
+ * ext4_ext_path_cache_put(), and might be NULL on error.
+ */
+static int ext4_find_extent_cached(struct inode *inode, ext4_lblk_t block,
+				   struct ext4_ext_path **orig_path)
+{
+	struct ext4_ext_path_cache *pc = ext4_ext_path_cache_get();
+	struct ext4_ext_path *path;
+	struct ext4_extent *ex;
+	int depth;
+
+	if (!pc)
+		return ext4_find_extent(inode, block, orig_path, 0);
+
+	path = pc->pc_path;
+	pc->pc_path = NULL;
+	*orig_path = path;
+
+	if (!path || pc->pc_inode != inode || pc->pc_gen != inode->i_ext_gen ||
+	    !ext4_ext_path_covers(path, block))
+		return ext4_find_extent(inode, block, orig_path, 0);
+
+	/* Same leaf: look for the extent in it, unless it is the last one */
+	depth = path->p_depth;
+	ex = path[depth].p_ext;
+	if (!ex || block < le32_to_cpu(ex->ee_block) ||
+	    (ex != EXT_LAST_EXTENT(path[depth].p_hdr) &&
+	     block >= le32_to_cpu(ex[1].ee_block))) {
+		ext4_ext_binsearch(inode, path + depth, block);
+		if (path[depth].p_ext)
+			path[depth].p_block = ext4_ext_pblock(path[depth].p_ext);
+	}
+
+	return 0;
+}
+
+/*
+ * Hand @path back to the cache of this thread.  Its buffers stay
+ * referenced only if the extents of @inode are still those of generation
+ * @gen, which the path was looked up in.
+ */
+static void ext4_ext_path_cache_put(struct inode *inode,
+				    struct ext4_ext_path *path,
+				    unsigned long gen)
+{
+	struct ext4_ext_path_cache *pc = ext_path_cache;
+
+	if (!pc || pc->pc_path) {
+		ext4_ext_drop_refs(path, 0);
+		kfree(path);
+		return;
+	}
+
+	if (inode->i_ext_gen != gen) {
+		ext4_ext_drop_refs(path, 0);
+		inode = NULL;
+	}
+	pc->pc_inode = inode;
+	pc->pc_gen = gen;
+	pc->pc_path = path;
+}
+
 static int ext4_ext_init_header(struct inode *inode, struct ext4_extent_header *eh, int depth)
 {
 	eh->eh_entries = 0;
@@ -478,6 +619,7 @@ static int ext4_ext_split_node(struct inode *inode,
 	bh = fs_bwrite(newblock, &ret);
 	if (!bh)
 		goto cleanup;
+	set_buffer_meta(bh);
 
 	if (at == depth) {
 		/* start copy from next extent */
@@ -514,6 +656,13 @@ static int ext4_ext_split_node(struct inode *inode,
 		}
 	}
 cleanup:
+	if (bh) {
+		/* Once complete, nothing is read over the new block before
+		 * the caller marks it dirty */
+		if (!ret)
+			set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+	}
 	if (ret) {
 		if (bh) {
 			fs_brelse(bh);
@@ -943,6 +1092,7 @@ static int ext4_ext_grow_indepth(struct inode *inode,
 		ext4_ext_free_blocks(inode, newblock, 1, 0);
 		return err;
 	}
+	set_buffer_meta(bh);
 
 	/* move top-level index/leaf into new block */
 	memmove(bh->b_data, inode->i_data, sizeof(inode->i_data));
@@ -972,6 +1122,7 @@ static int ext4_ext_grow_indepth(struct inode *inode,
 	le16_add_cpu(&neh->eh_depth, 1);
 
 	fs_mark_buffer_dirty(bh);
+	unlock_buffer(bh);
 	ext4_mark_inode_dirty(inode);
 	fs_brelse(bh);
 
@@ -1081,6 +1232,10 @@ int ext4_ext_insert_extent(struct inode *inode, struct ext4_ext_path **ppath, st
 	struct ext4_ext_path *path = *ppath;
 	struct ext_split_trans *spt = NULL, newblock = {0};
 
+	inode_extents_changed(inode);
+	ext4_es_remove_extent(inode, le32_to_cpu(newext->ee_block),
+			      le32_to_cpu(newext->ee_block) +
+			      ext4_ext_get_actual_len(newext) - 1);
 	depth = ext_depth(inode);
 	for (i = depth, level = 0;i >= 0;i--, level++)
 		if (EXT_HAS_FREE_INDEX(path + i))
@@ -1307,6 +1462,8 @@ int ext4_ext_remove_space(struct inode *inode, ext4_lblk_t from, ext4_lblk_t to)
 	struct ext4_ext_path *path = NULL;
 	int ret, depth = ext_depth(inode), i;
 
+	inode_extents_changed(inode);
+	ext4_es_remove_extent(inode, from, to);
 	ret = ext4_find_extent(inode, from, &path, 0);
 	if (ret)
 		goto out;
@@ -1547,14 +1704,26 @@ int ext4_ext_get_blocks(void *handle, struct inode *inode, ext4_fsblk_t iblock,
 {
 	struct ext4_ext_path *path = NULL;
 	struct ext4_extent newex, *ex;
+	struct extent_status es;
 	int goal, err = 0, depth;
-	unsigned long allocated = 0;
+	unsigned long allocated = 0, gen = 0;
 	ext4_fsblk_t next, newblock;
 
 	clear_buffer_new(bh_result);
 
+	if (ext4_es_lookup_extent(inode, iblock, &es)) {
+		if (es.es_pblk) {
+			newblock = iblock - es.es_lblk + es.es_pblk;
+			allocated = es.es_len - (iblock - es.es_lblk);
+			goto out;
+		}
+		if (!create)
+			goto out2;
+	}
+
 	/* find extent for this block */
-	err = ext4_find_extent(inode, iblock, &path, 0);
+	gen = inode->i_ext_gen;
+	err = ext4_find_extent_cached(inode, iblock, &path);
 	if (err) {
 		path = NULL;
 		goto out2;
@@ -1576,21 +1745,28 @@ int ext4_ext_get_blocks(void *handle, struct inode *inode, ext4_fsblk_t iblock,
 			newblock = iblock - ee_block + ee_start;
 			/* number of remain blocks in the extent */
 			allocated = ee_len - (iblock - ee_block);
+			ext4_es_insert_extent(inode, ee_block, ee_len, ee_start);
 			goto out;
 		}
 	}
 
+	/* find next allocated block so that we know how many
+	 * blocks we can allocate without ovelapping next extent */
+	next = ext4_ext_next_allocated_block(path);
+
 	/*
 	 * requested block isn't allocated yet
 	 * we couldn't try to create block if create flag is zero
 	 */
 	if (!create) {
+		/* remember the hole up to the next extent, which is the
+		 * one found if the block lies before the first extent */
+		if (ex && iblock < le32_to_cpu(ex->ee_block))
+			next = le32_to_cpu(ex->ee_block);
+		ext4_es_insert_extent(inode, iblock, next - iblock, 0);
 		goto out2;
 	}
 
-	/* find next allocated block so that we know how many
-	 * blocks we can allocate without ovelapping next extent */
-	next = ext4_ext_next_allocated_block(path);
 	allocated = next - iblock;
 	if (allocated > max_blocks)
 		allocated = max_blocks;
@@ -1627,10 +1803,8 @@ out:
 	bh_result->b_bdev = NULL;
 	bh_result->b_blocknr = newblock;
 out2:
-	if (path) {
-		ext4_ext_drop_refs(path, 0);
-		kfree(path);
-	}
+	if (path)
+		ext4_ext_path_cache_put(inode, path, err ? 0 : gen);
 
 	return err ? err : allocated;
 }
@@ -123,6 +123,11 @@ find_ext4_extent_tail(struct ext4_extent_header *eh)
 					   EXT4_EXTENT_TAIL_OFFSET(eh));
 }
 
+/*
+ * Maximum depth of the extent tree, as enforced by the kernel.
+ */
+#define EXT4_MAX_EXTENT_DEPTH 5
+
 /*
  * Array of ext4_ext_path contains path to some extent.
  * Creation/lookup routines use it for traversal/splitting/etc.
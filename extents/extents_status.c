@@ -0,0 +1,240 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licens
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-
+ */
+
+/*
+ * Extent status tree: the mappings resolved by ext4_ext_get_blocks(),
+ * holes included, kept in an rbtree per inode so that looking a block
+ * up again costs neither a walk down the extent tree nor any buffer.
+ * ext4_ext_insert_extent() and ext4_ext_remove_space() drop the
+ * ranges they change.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "extents_status.h"
+#include "../inode.h"
+#include "../logging.h"
+
+static inline ext4_lblk_t es_end(struct extent_status *es)
+{
+	return es->es_lblk + es->es_len - 1;
+}
+
+void ext4_es_init_tree(struct ext4_es_tree *tree)
+{
+	pthread_mutex_init(&tree->es_lock, NULL);
+	tree->es_root = EVENT_RB_ROOT;
+	tree->es_nr = 0;
+}
+
+/* Called with es_lock held. */
+static void __es_free_all(struct ext4_es_tree *tree)
+{
+	struct rb_node *node;
+
+	while ((node = rb_first(&tree->es_root))) {
+		rb_erase(node, &tree->es_root);
+		free(rb_entry(node, struct extent_status, es_node));
+	}
+	tree->es_nr = 0;
+}
+
+void ext4_es_free_tree(struct ext4_es_tree *tree)
+{
+	__es_free_all(tree);
+	pthread_mutex_destroy(&tree->es_lock);
+}
+
+/*
+ * Find the extent containing @lblk, or else the first one after it.
+ * Called with es_lock held.
+ */
+static struct extent_status *__es_find(struct ext4_es_tree *tree,
+				       ext4_lblk_t lblk)
+{
+	struct rb_node *node = tree->es_root.rb_node;
+	struct extent_status *es = NULL;
+
+	while (node) {
+		es = rb_entry(node, struct extent_status, es_node);
+		if (lblk < es->es_lblk)
+			node = node->rb_left;
+		else if (lblk > es_end(es))
+			node = node->rb_right;
+		else
+			return es;
+	}
+
+	if (es && lblk > es_end(es)) {
+		node = rb_next(&es->es_node);
+		es = node ? rb_entry(node, struct extent_status, es_node) :
+			    NULL;
+	}
+	return es;
+}
+
+static int es_cmp(struct rb_node *a, struct rb_node *b)
+{
+	struct extent_status *ea = rb_entry(a, struct extent_status, es_node);
+	struct extent_status *eb = rb_entry(b, struct extent_status, es_node);
+
+	if (ea->es_lblk < eb->es_lblk)
+		return -1;
+	return ea->es_lblk > eb->es_lblk;
+}
+
+/* Whether @b maps the blocks following @a the same way. */
+static int es_can_merge(struct extent_status *a, struct extent_status *b)
+{
+	if (es_end(a) + 1 != b->es_lblk)
+		return 0;
+	if ((uint64_t)a->es_len + b->es_len > (ext4_lblk_t)-1)
+		return 0;
+	if (!a->es_pblk || !b->es_pblk)
+		return !a->es_pblk && !b->es_pblk;
+	return a->es_pblk + a->es_len == b->es_pblk;
+}
+
+/*
+ * Look @lblk up.  If its mapping is known, 1 is returned and the extent
+ * containing it is copied to @es.
+ */
+int ext4_es_lookup_extent(struct inode *inode, ext4_lblk_t lblk,
+			  struct extent_status *es)
+{
+	struct ext4_es_tree *tree = &inode->i_es_tree;
+	struct extent_status *es1;
+	int found = 0;
+
+	pthread_mutex_lock(&tree->es_lock);
+	es1 = __es_find(tree, lblk);
+	if (es1 && es1->es_lblk <= lblk) {
+		es->es_lblk = es1->es_lblk;
+		es->es_len = es1->es_len;
+		es->es_pblk = es1->es_pblk;
+		found = 1;
+	}
+	pthread_mutex_unlock(&tree->es_lock);
+
+	return found;
+}
+
+/* Called with es_lock held. */
+static void __es_remove_extent(struct ext4_es_tree *tree, ext4_lblk_t from,
+			       ext4_lblk_t to)
+{
+	struct extent_status *es = __es_find(tree, from);
+
+	while (es && es->es_lblk <= to) {
+		struct rb_node *next = rb_next(&es->es_node);
+		ext4_lblk_t end = es_end(es);
+
+		if (es->es_lblk < from && end > to) {
+			/* Split it in two */
+			struct extent_status *tail;
+
+			tail = malloc(sizeof(struct extent_status));
+			if (tail) {
+				tail->es_lblk = to + 1;
+				tail->es_len = end - to;
+				tail->es_pblk = es->es_pblk ?
+					es->es_pblk + (to + 1 - es->es_lblk) : 0;
+				rb_insert(&tree->es_root, &tail->es_node, es_cmp);
+				tree->es_nr++;
+			}
+			es->es_len = from - es->es_lblk;
+			break;
+		} else if (es->es_lblk < from) {
+			es->es_len = from - es->es_lblk;
+		} else if (end > to) {
+			if (es->es_pblk)
+				es->es_pblk += to + 1 - es->es_lblk;
+			es->es_len = end - to;
+			es->es_lblk = to + 1;
+		} else {
+			rb_erase(&es->es_node, &tree->es_root);
+			free(es);
+			tree->es_nr--;
+		}
+
+		es = next ? rb_entry(next, struct extent_status, es_node) :
+			    NULL;
+	}
+}
+
+/*
+ * Forget about the mapping of blocks @from to @to, inclusive.  Called
+ * whenever the extent tree changes, with the inode locked exclusively.
+ */
+void ext4_es_remove_extent(struct inode *inode, ext4_lblk_t from,
+			   ext4_lblk_t to)
+{
+	struct ext4_es_tree *tree = &inode->i_es_tree;
+
+	pthread_mutex_lock(&tree->es_lock);
+	__es_remove_extent(tree, from, to);
+	pthread_mutex_unlock(&tree->es_lock);
+}
+
+/*
+ * Remember that @len blocks from @lblk map to @pblk on, or are a hole
+ * if @pblk is 0.  The range is merged with the adjacent ones where
+ * possible.
+ */
+void ext4_es_insert_extent(struct inode *inode, ext4_lblk_t lblk,
+			   ext4_lblk_t len, ext4_fsblk_t pblk)
+{
+	struct ext4_es_tree *tree = &inode->i_es_tree;
+	struct extent_status *es, *prev, *next;
+	struct rb_node *node;
+
+	if (!len)
+		return;
+
+	es = malloc(sizeof(struct extent_status));
+	if (!es)
+		return;
+	es->es_lblk = lblk;
+	es->es_len = len;
+	es->es_pblk = pblk;
+
+	pthread_mutex_lock(&tree->es_lock);
+	if (tree->es_nr >= ES_MAX_EXTENTS)
+		__es_free_all(tree);
+	__es_remove_extent(tree, lblk, lblk + len - 1);
+	rb_insert(&tree->es_root, &es->es_node, es_cmp);
+	tree->es_nr++;
+
+	node = rb_prev(&es->es_node);
+	prev = node ? rb_entry(node, struct extent_status, es_node) : NULL;
+	if (prev && es_can_merge(prev, es)) {
+		prev->es_len += es->es_len;
+		rb_erase(&es->es_node, &tree->es_root);
+		free(es);
+		tree->es_nr--;
+		es = prev;
+	}
+
+	node = rb_next(&es->es_node);
+	next = node ? rb_entry(node, struct extent_status, es_node) : NULL;
+	if (next && es_can_merge(es, next)) {
+		es->es_len += next->es_len;
+		rb_erase(&next->es_node, &tree->es_root);
+		free(next);
+		tree->es_nr--;
+	}
+	pthread_mutex_unlock(&tree->es_lock);
+}
@@ -0,0 +1,57 @@
+#ifndef _EXTENTS_STATUS_H
+#define _EXTENTS_STATUS_H
+
+#include "../types/ext4_basic.h"
+#include "../types/rbtree.h"
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licens
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-
+ */
+
+/*
+ * A range of logical blocks whose mapping is known: es_pblk is the
+ * physical block of es_lblk, or 0 if the range is a hole.
+ */
+struct extent_status {
+	struct rb_node es_node;
+	ext4_lblk_t es_lblk;
+	ext4_lblk_t es_len;
+	ext4_fsblk_t es_pblk;
+};
+
+/*
+ * The extent status tree of an inode, protected by its own lock as it
+ * is filled in by lookups, which only hold the inode lock shared.
+ */
+struct ext4_es_tree {
+	pthread_mutex_t es_lock;
+	struct rb_root es_root;
+	unsigned long es_nr;
+};
+
+/* The tree of an inode is dropped as a whole once it gets this big */
+#define ES_MAX_EXTENTS 4096
+
+struct inode;
+
+void ext4_es_init_tree(struct ext4_es_tree *tree);
+void ext4_es_free_tree(struct ext4_es_tree *tree);
+int ext4_es_lookup_extent(struct inode *inode, ext4_lblk_t lblk,
+			  struct extent_status *es);
+void ext4_es_insert_extent(struct inode *inode, ext4_lblk_t lblk,
+			   ext4_lblk_t len, ext4_fsblk_t pblk);
+void ext4_es_remove_extent(struct inode *inode, ext4_lblk_t from,
+			   ext4_lblk_t to);
+
+#endif
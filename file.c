@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "file.h"
+#include "logging.h"
+
+struct e4f_file *file_open(uint32_t ino, int *ret)
+{
+	struct e4f_file *file;
+
+	file = calloc(1, sizeof(struct e4f_file));
+	if (!file) {
+		*ret = -ENOMEM;
+		return NULL;
+	}
+
+	file->f_inode = inode_get(ino, ret);
+	if (!file->f_inode) {
+		free(file);
+		return NULL;
+	}
+	pthread_mutex_init(&file->f_lock, NULL);
+
+	return file;
+}
+
+void file_release(struct e4f_file *file)
+{
+	inode_put(file->f_inode);
+	pthread_mutex_destroy(&file->f_lock);
+	free(file);
+}
+
+/*
+ * inode_get_data_pblock() for an open file: a block within the extent
+ * mapped last is found without looking the extent tree up.  Called
+ * with the inode locked, shared unless @create is set.
+ */
+uint64_t file_get_data_pblock(struct e4f_file *file, uint32_t lblock,
+			      uint32_t *extent_len, int create)
+{
+	struct inode *inode = file->f_inode;
+	struct extent_cursor *ec = &file->f_ext;
+	uint32_t len;
+	uint64_t pblock;
+
+	pthread_mutex_lock(&file->f_lock);
+	if (ec->ec_len && ec->ec_gen == inode->i_ext_gen &&
+	    lblock - ec->ec_lblk < ec->ec_len) {
+		len = ec->ec_len - (lblock - ec->ec_lblk);
+		pblock = ec->ec_pblk + (lblock - ec->ec_lblk);
+		pthread_mutex_unlock(&file->f_lock);
+
+		if (extent_len) {
+			if (create && *extent_len)
+				len = MIN(len, *extent_len);
+			*extent_len = len;
+		}
+		return pblock;
+	}
+	pthread_mutex_unlock(&file->f_lock);
+
+	len = extent_len ? *extent_len : 1;
+	pblock = inode_get_data_pblock(inode, lblock, &len, create);
+	if (extent_len)
+		*extent_len = len;
+	if (!pblock || !len)
+		return pblock;
+
+	pthread_mutex_lock(&file->f_lock);
+	ec->ec_lblk = lblock;
+	ec->ec_len = len;
+	ec->ec_pblk = pblock;
+	ec->ec_gen = inode->i_ext_gen;
+	pthread_mutex_unlock(&file->f_lock);
+
+	return pblock;
+}
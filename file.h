@@ -0,0 +1,41 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "inode.h"
+#include "readahead.h"
+
+/*
+ * The mapping of the last extent looked up through an open file, valid
+ * as long as ec_gen matches the inode's i_ext_gen.  ec_len is 0 when
+ * nothing is cached.
+ */
+struct extent_cursor {
+	uint32_t ec_lblk;
+	uint32_t ec_len;
+	uint64_t ec_pblk;
+	unsigned long ec_gen;
+};
+
+/*
+ * An open file, pointed to by fi->fh from op_open() to op_release().
+ * The inode is pinned for as long as the file is open.
+ */
+struct e4f_file {
+	struct inode *f_inode;
+
+	pthread_mutex_t f_lock;		/* protects the state below */
+	struct extent_cursor f_ext;
+	struct file_ra_state f_ra;
+};
+
+#define FI_FILE(fi) ((struct e4f_file *)(uintptr_t)(fi)->fh)
+
+struct e4f_file *file_open(uint32_t ino, int *ret);
+void file_release(struct e4f_file *file);
+uint64_t file_get_data_pblock(struct e4f_file *file, uint32_t lblock,
+			      uint32_t *extent_len, int create);
+
+#endif
@@ -12,6 +12,7 @@
 
 
 #include <fuse.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
@@ -23,6 +24,7 @@
 
 #include "common.h"
 #include "buffer.h"
+#include "dcache.h"
 #include "inode.h"
 #include "logging.h"
 #include "ops.h"
@@ -39,6 +41,7 @@ static struct fuse_operations e4f_ops = {
     .getattr    = op_getattr,
     .readdir    = op_readdir,
     .open       = op_open,
+    .release    = op_release,
     .read       = op_read,
     .write      = op_write,
     .truncate   = op_truncate,
@@ -50,10 +53,22 @@ static struct fuse_operations e4f_ops = {
 static struct e4f {
     char *disk;
     char *logfile;
+    char *cache_policy;
+    char *cache_size;
+    char *dcache_size;
+    unsigned int dirty_background_ratio;
+    unsigned int dirty_ratio;
+    unsigned int dirty_expire;
 } e4f;
 
 static struct fuse_opt e4f_opts[] = {
     { "logfile=%s", offsetof(struct e4f, logfile), 0 },
+    { "cache_policy=%s", offsetof(struct e4f, cache_policy), 0 },
+    { "cache_size=%s", offsetof(struct e4f, cache_size), 0 },
+    { "dcache_size=%s", offsetof(struct e4f, dcache_size), 0 },
+    { "dirty_background_ratio=%u", offsetof(struct e4f, dirty_background_ratio), 0 },
+    { "dirty_ratio=%u", offsetof(struct e4f, dirty_ratio), 0 },
+    { "dirty_expire=%u", offsetof(struct e4f, dirty_expire), 0 },
     FUSE_OPT_END
 };
 
@@ -78,6 +93,35 @@ static int e4f_opt_proc(void *data, const char *arg, int key,
     }
 }
 
+/* Parse a size in bytes, with an optional K, M or G suffix */
+static int parse_size(const char *s, size_t *size)
+{
+    char *end;
+    unsigned long long val;
+    int shift = 0;
+
+    /* strtoull() would take "-1" for ULLONG_MAX */
+    if (!isdigit((unsigned char)*s))
+        return -1;
+
+    errno = 0;
+    val = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return -1;
+
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end || val > (SIZE_MAX >> shift))
+        return -1;
+    val <<= shift;
+
+    *size = val;
+    return 0;
+}
+
 void signal_handle_sigsegv(int signal)
 {
     UNUSED(signal);
@@ -111,6 +155,12 @@ int main(int argc, char *argv[])
     // Default options
     e4f.disk = NULL;
     e4f.logfile = DEFAULT_LOG_FILE;
+    e4f.cache_policy = NULL;
+    e4f.cache_size = NULL;
+    e4f.dcache_size = NULL;
+    e4f.dirty_background_ratio = BH_DIRTY_BACKGROUND_RATIO_DEFAULT;
+    e4f.dirty_ratio = BH_DIRTY_RATIO_DEFAULT;
+    e4f.dirty_expire = BH_DIRTY_EXPIRE_DEFAULT;
 
     if (fuse_opt_parse(&args, &e4f, e4f_opts, e4f_opt_proc) == -1) {
         return EXIT_FAILURE;
@@ -122,6 +172,38 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (fs_cache_set_policy(e4f.cache_policy) < 0) {
+        fprintf(stderr, "Unknown cache policy: %s\n", e4f.cache_policy);
+        return EXIT_FAILURE;
+    }
+
+    if (e4f.cache_size) {
+        size_t cache_size;
+
+        if (parse_size(e4f.cache_size, &cache_size) < 0) {
+            fprintf(stderr, "Invalid cache size: %s\n", e4f.cache_size);
+            return EXIT_FAILURE;
+        }
+        fs_cache_set_size(cache_size);
+    }
+
+    if (e4f.dcache_size) {
+        size_t dcache_size;
+
+        if (parse_size(e4f.dcache_size, &dcache_size) < 0) {
+            fprintf(stderr, "Invalid dcache size: %s\n", e4f.dcache_size);
+            return EXIT_FAILURE;
+        }
+        dcache_set_size(dcache_size);
+    }
+
+    if (fs_cache_set_dirty(e4f.dirty_background_ratio, e4f.dirty_ratio,
+                           e4f.dirty_expire) < 0) {
+        fprintf(stderr, "Invalid dirty ratios: %u/%u\n",
+                e4f.dirty_background_ratio, e4f.dirty_ratio);
+        return EXIT_FAILURE;
+    }
+
     if (logging_open(e4f.logfile) < 0) {
         fprintf(stderr, "Failed to initialize logging\n");
         return EXIT_FAILURE;
@@ -150,6 +232,7 @@ int main(int argc, char *argv[])
     fuse_opt_free_args(&args);
     free(e4f.disk);
     DEBUG("Uninitializing...");
+    inode_uninit();
     super_group_uninit();
     super_uninit();
     fs_cache_cleanup();
@@ -0,0 +1,442 @@
+/*
+ * Lookups in htree (dir_index) directories.  The name hashes are those of
+ * fs/ext4/hash.c in Linux, and the walk down the index follows dx_probe()
+ * and ext4_htree_next_block() in fs/ext4/namei.c.
+ *
+ * Copyright (C) 2002 by Theodore Ts'o
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "htree.h"
+#include "inode.h"
+#include "logging.h"
+#include "super.h"
+
+#define DELTA 0x9E3779B9
+
+static void TEA_transform(uint32_t buf[4], uint32_t const in[])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+
+	do {
+		sum += DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+static inline uint32_t rol32(uint32_t word, unsigned int shift)
+{
+	return (word << shift) | (word >> (32 - shift));
+}
+
+/* F, G and H are basic MD4 functions: selection, majority, parity */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+/*
+ * The generic round function.  The application is so specific that
+ * we don't bother protecting all the arguments with parens, as is generally
+ * good macro practice, in favor of extra legibility.
+ * Rotation is separate from addition to prevent recomputation
+ */
+#define ROUND(f, a, b, c, d, x, s)	\
+	(a += f(b, c, d) + x, a = rol32(a, s))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+/*
+ * Basic cut-down MD4 transform.  Returns only 32 bits of result.
+ */
+static uint32_t half_md4_transform(uint32_t buf[4], uint32_t const in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	/* Round 1 */
+	ROUND(F, a, b, c, d, in[0] + K1,  3);
+	ROUND(F, d, a, b, c, in[1] + K1,  7);
+	ROUND(F, c, d, a, b, in[2] + K1, 11);
+	ROUND(F, b, c, d, a, in[3] + K1, 19);
+	ROUND(F, a, b, c, d, in[4] + K1,  3);
+	ROUND(F, d, a, b, c, in[5] + K1,  7);
+	ROUND(F, c, d, a, b, in[6] + K1, 11);
+	ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+	/* Round 2 */
+	ROUND(G, a, b, c, d, in[1] + K2,  3);
+	ROUND(G, d, a, b, c, in[3] + K2,  5);
+	ROUND(G, c, d, a, b, in[5] + K2,  9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2,  3);
+	ROUND(G, d, a, b, c, in[2] + K2,  5);
+	ROUND(G, c, d, a, b, in[4] + K2,  9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	/* Round 3 */
+	ROUND(H, a, b, c, d, in[3] + K3,  3);
+	ROUND(H, d, a, b, c, in[7] + K3,  9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3,  3);
+	ROUND(H, d, a, b, c, in[5] + K3,  9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+
+	return buf[1]; /* "most hashed" word */
+}
+#undef ROUND
+#undef K1
+#undef K2
+#undef K3
+#undef F
+#undef G
+#undef H
+
+/* The old legacy hash */
+static uint32_t dx_hack_hash_unsigned(const char *name, int len)
+{
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	const unsigned char *ucp = (const unsigned char *) name;
+
+	while (len--) {
+		hash = hash1 + (hash0 ^ (((int) *ucp++) * 7152373));
+
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static uint32_t dx_hack_hash_signed(const char *name, int len)
+{
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	const signed char *scp = (const signed char *) name;
+
+	while (len--) {
+		hash = hash1 + (hash0 ^ (((int) *scp++) * 7152373));
+
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static void str2hashbuf_signed(const char *msg, int len, uint32_t *buf, int num)
+{
+	uint32_t pad, val;
+	int i;
+	const signed char *scp = (const signed char *) msg;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		val = ((int) scp[i]) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+static void str2hashbuf_unsigned(const char *msg, int len, uint32_t *buf, int num)
+{
+	uint32_t pad, val;
+	int i;
+	const unsigned char *ucp = (const unsigned char *) msg;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		val = ((int) ucp[i]) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+/* Hash value past all others, which no name may hash to */
+#define HTREE_EOF_32BIT		0x7fffffffU
+
+/*
+ * Returns the hash of a name with one of the DX_HASH_* versions.  An all
+ * zero seed means the default one.  Fails with -EINVAL for a version not
+ * understood.
+ */
+int htree_dirhash(int version, const uint32_t seed[4], const char *name,
+		  int len, uint32_t *hash_out)
+{
+	uint32_t hash;
+	const char *p;
+	int i;
+	uint32_t in[8], buf[4];
+	void (*str2hashbuf)(const char *, int, uint32_t *, int) =
+				str2hashbuf_signed;
+
+	/* Initialize the default seed for the hash checksum functions */
+	buf[0] = 0x67452301;
+	buf[1] = 0xefcdab89;
+	buf[2] = 0x98badcfe;
+	buf[3] = 0x10325476;
+
+	/* Check to see if the seed is all zero's */
+	for (i = 0; i < 4; i++) {
+		if (seed[i]) {
+			memcpy(buf, seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (version) {
+	case DX_HASH_LEGACY_UNSIGNED:
+		hash = dx_hack_hash_unsigned(name, len);
+		break;
+	case DX_HASH_LEGACY:
+		hash = dx_hack_hash_signed(name, len);
+		break;
+	case DX_HASH_HALF_MD4_UNSIGNED:
+		str2hashbuf = str2hashbuf_unsigned;
+		/* fall through */
+	case DX_HASH_HALF_MD4:
+		p = name;
+		while (len > 0) {
+			(*str2hashbuf)(p, len, in, 8);
+			half_md4_transform(buf, in);
+			len -= 32;
+			p += 32;
+		}
+		hash = buf[1];
+		break;
+	case DX_HASH_TEA_UNSIGNED:
+		str2hashbuf = str2hashbuf_unsigned;
+		/* fall through */
+	case DX_HASH_TEA:
+		p = name;
+		while (len > 0) {
+			(*str2hashbuf)(p, len, in, 4);
+			TEA_transform(buf, in);
+			len -= 16;
+			p += 16;
+		}
+		hash = buf[0];
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	hash = hash & ~1;
+	if (hash == (HTREE_EOF_32BIT << 1))
+		hash = (HTREE_EOF_32BIT - 1) << 1;
+	*hash_out = hash;
+	return 0;
+}
+
+static inline struct dx_entry *htree_frame_entries(uint8_t *block,
+						  struct htree_frame *frame)
+{
+	return (struct dx_entry *)(block + frame->entries);
+}
+
+/*
+ * Reads the count and limit of the index node in lblock, whose entries
+ * start at offset, and checks they fit the block.
+ */
+static int htree_frame_load(struct inode_dir_iter *it, uint32_t lblock,
+			    unsigned int offset, struct htree_frame *frame)
+{
+	uint8_t *block = inode_dir_iter_block(it, lblock);
+	struct dx_countlimit *cl;
+	unsigned int count, limit;
+
+	if (!block)
+		return -EIO;
+	cl = (struct dx_countlimit *)(block + offset);
+	count = le16_to_cpu(cl->count);
+	limit = le16_to_cpu(cl->limit);
+
+	if (!count || count > limit ||
+	    offset + limit * sizeof(struct dx_entry) > BLOCK_SIZE) {
+		WARNING("Bad htree node in directory %u, lblock %u: "
+			"count %u, limit %u", it->inode->i_ino, lblock, count, limit);
+		return -EIO;
+	}
+
+	frame->lblock = lblock;
+	frame->entries = offset;
+	frame->count = count;
+	frame->at = 0;
+	return 0;
+}
+
+/*
+ * Walks down the index of the directory to the leaf block which names
+ * hashing like name are stored in, and returns its lblock.  If the name
+ * is not there, the caller goes on with htree_next_leaf(), as names with
+ * the same hash might spill over to the next leaves.
+ *
+ * Fails with -ENOTDIR if the directory is not indexed, or with another
+ * error if the index can't be used: either way, scanning all of the
+ * directory still works.  it has to be started on the directory.
+ */
+int htree_find_leaf(struct inode_dir_iter *it, const char *name, int namelen,
+		    struct htree_path *path, uint32_t *lblock)
+{
+	struct inode *dir = it->inode;
+	int max_levels = super_dx_max_levels();
+	struct dx_root *root;
+	struct htree_frame *frame;
+	uint32_t seed[4];
+	int version, levels, err;
+
+	if (!max_levels || !(dir->raw_inode->i_flags & EXT4_INDEX_FL))
+		return -ENOTDIR;
+
+	root = (struct dx_root *)inode_dir_iter_block(it, 0);
+	if (!root)
+		return -EIO;
+	version = root->info.hash_version;
+	levels = root->info.indirect_levels;
+	if (root->info.unused_flags & 1 || levels >= max_levels) {
+		WARNING("Unsupported htree in directory %u: flags %#x, "
+			"%d levels", dir->i_ino, root->info.unused_flags,
+			levels);
+		return -EOPNOTSUPP;
+	}
+
+	if (super_dx_hash_info(seed) && version <= DX_HASH_TEA)
+		version += DX_HASH_LEGACY_UNSIGNED;
+	err = htree_dirhash(version, seed, name, namelen, &path->hash);
+	if (err) {
+		WARNING("Unsupported htree hash version %d in directory %u",
+			version, dir->i_ino);
+		return err;
+	}
+
+	path->nr_frames = 0;
+	err = htree_frame_load(it, 0, offsetof(struct dx_root, info) +
+			       root->info.info_length, &path->frames[0]);
+	for (;;) {
+		struct dx_entry *entries, *p, *q, *m;
+		uint8_t *block;
+
+		if (err)
+			return err;
+
+		frame = &path->frames[path->nr_frames++];
+		block = inode_dir_iter_block(it, frame->lblock);
+		if (!block)
+			return -EIO;
+		entries = htree_frame_entries(block, frame);
+
+		/* The hash of the first entry is its count and limit */
+		p = entries + 1;
+		q = entries + frame->count - 1;
+		while (p <= q) {
+			m = p + (q - p) / 2;
+			if (le32_to_cpu(m->hash) > path->hash)
+				q = m - 1;
+			else
+				p = m + 1;
+		}
+		frame->at = p - 1 - entries;
+		*lblock = le32_to_cpu(entries[frame->at].block) & 0x0fffffff;
+
+		if (!levels--)
+			return 0;
+
+		err = htree_frame_load(it, *lblock,
+				       offsetof(struct dx_node, entries),
+				       &path->frames[path->nr_frames]);
+	}
+}
+
+/*
+ * Moves on to the leaf after the one found last, if it might hold names
+ * with the hash looked up.  Returns 1 with its lblock, 0 if there are no
+ * more leaves to look at, or an error.
+ */
+int htree_next_leaf(struct inode_dir_iter *it, struct htree_path *path,
+		    uint32_t *lblock)
+{
+	struct htree_frame *frame = &path->frames[path->nr_frames - 1];
+	struct dx_entry *entries;
+	uint8_t *block;
+	int depth = path->nr_frames - 1;
+	uint32_t hash;
+	int err;
+
+	/* Find the lowest node with entries left, the leaves below it will
+	 * be the first ones of their parents */
+	while (frame->at + 1 >= frame->count) {
+		if (frame == path->frames)
+			return 0;
+		frame--;
+	}
+	frame->at++;
+
+	block = inode_dir_iter_block(it, frame->lblock);
+	if (!block)
+		return -EIO;
+	entries = htree_frame_entries(block, frame);
+	hash = le32_to_cpu(entries[frame->at].hash);
+	/* The low bit tells the block continues the hash of the previous */
+	if ((hash & ~1) != path->hash)
+		return 0;
+
+	*lblock = le32_to_cpu(entries[frame->at].block) & 0x0fffffff;
+	while (frame < path->frames + depth) {
+		frame++;
+		err = htree_frame_load(it, *lblock,
+				       offsetof(struct dx_node, entries), frame);
+		if (err)
+			return err;
+		entries = htree_frame_entries(inode_dir_iter_block(it, *lblock),
+					      frame);
+		*lblock = le32_to_cpu(entries[0].block) & 0x0fffffff;
+	}
+
+	return 1;
+}
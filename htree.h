@@ -0,0 +1,32 @@
+#ifndef HTREE_H
+#define HTREE_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+/* Index blocks on the way to a leaf, root included, with largedir */
+#define HTREE_MAX_FRAMES	3
+
+struct htree_frame {
+	uint32_t lblock;	/* of the index block */
+	uint16_t entries;	/* offset of its dx_entry array */
+	uint16_t count;
+	uint16_t at;		/* entry followed */
+};
+
+/* Where a lookup went down the index, for htree_next_leaf() */
+struct htree_path {
+	uint32_t hash;
+	int nr_frames;
+	struct htree_frame frames[HTREE_MAX_FRAMES];
+};
+
+int htree_dirhash(int version, const uint32_t seed[4], const char *name,
+		  int len, uint32_t *hash);
+int htree_find_leaf(struct inode_dir_iter *it, const char *name, int namelen,
+		    struct htree_path *path, uint32_t *lblock);
+int htree_next_leaf(struct inode_dir_iter *it, struct htree_path *path,
+		    uint32_t *lblock);
+
+#endif
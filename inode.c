@@ -14,9 +14,11 @@
 #include <errno.h>
 #include <inttypes.h>
 
+#include "buffer.h"
 #include "dcache.h"
 #include "disk.h"
 #include "extents/extents.h"
+#include "htree.h"
 #include "inode.h"
 #include "logging.h"
 #include "super.h"
@@ -31,6 +33,7 @@
 #define MAX_TIND_BLOCK              (MAX_DIND_BLOCK + ADDRESSES_IN_TIND_BLOCK)
 
 #define ROOT_INODE_N                2
+#define DIR_RA_BYTES                (128 << 10)
 #define IS_PATH_SEPARATOR(__c)      ((__c) == '/')
 
 
@@ -106,81 +109,252 @@ int inode_remove_data_pblock(struct inode *inode, ext4_lblk_t from)
     return ext4_ext_remove_space(inode, from, -1UL);
 }
 
-static void dir_ctx_update(struct ext4_inode *raw_inode, uint32_t lblock, struct inode_dir_ctx *ctx)
+/* Maps lblock of the directory being walked.  Blocks within the extent
+ * mapped last are found without going to the extent tree again. */
+static uint64_t dir_iter_map(struct inode_dir_iter *it, uint32_t lblock)
 {
-    uint64_t dir_pblock;
-    struct inode *inode = inode_get(0, raw_inode);
-    dir_pblock = inode_get_data_pblock(inode, lblock, NULL, 0);
-    inode_put(inode);
-    disk_read_block(dir_pblock, ctx->buf);
-    ctx->lblock = lblock;
+    struct inode *inode = it->inode;
+    uint32_t len = 1;
+    uint64_t pblock;
+
+    if (it->run_len && it->run_gen == inode->i_ext_gen &&
+        lblock - it->run_lblock < it->run_len) {
+        return it->run_pblock + (lblock - it->run_lblock);
+    }
+
+    pblock = inode_get_data_pblock(inode, lblock, &len, 0);
+    it->run_lblock = lblock;
+    it->run_len = pblock ? len : 0;
+    it->run_pblock = pblock;
+    it->run_gen = inode->i_ext_gen;
+
+    return pblock;
 }
 
-struct inode_dir_ctx *inode_dir_ctx_get(void)
+/* Points the iterator at the start of inode, a directory */
+void inode_dir_iter_start(struct inode_dir_iter *it, struct inode *inode)
 {
-    return malloc(sizeof(struct inode_dir_ctx) + BLOCK_SIZE);
+    it->inode = inode;
+    it->lblock = UINT32_MAX;
+    it->bh = NULL;
+    it->run_len = 0;
+    it->ra_next = 0;
+    it->err = 0;
+    inode_dir_iter_seek(it, 0, inode_get_size(inode));
 }
 
-void inode_dir_ctx_reset(struct inode_dir_ctx *ctx, struct ext4_inode *inode)
+/* Drops the block the iterator holds, entries returned are gone with it */
+void inode_dir_iter_release(struct inode_dir_iter *it)
 {
-    dir_ctx_update(inode, 0, ctx);
+    if (it->bh) {
+        fs_brelse(it->bh);
+        it->bh = NULL;
+    }
+    it->lblock = UINT32_MAX;
 }
 
-void inode_dir_ctx_put(struct inode_dir_ctx *ctx)
+/* Restricts the walk to the entries between the byte offsets start and end */
+void inode_dir_iter_seek(struct inode_dir_iter *it, uint64_t start, uint64_t end)
 {
-    free(ctx);
+    it->pos = start;
+    it->end = MIN(end, inode_get_size(it->inode));
 }
 
-struct ext4_dir_entry_2 *inode_dentry_get(struct ext4_inode *raw_inode, off_t offset, struct inode_dir_ctx *ctx)
+/* Returns the contents of the directory block lblock as found in the buffer
+ * cache, which the iterator holds on to until it moves to another block.
+ * NULL if the block is a hole or can't be read, the latter also leaving an
+ * error in it->err. */
+uint8_t *inode_dir_iter_block(struct inode_dir_iter *it, uint32_t lblock)
 {
-    uint32_t lblock = offset / BLOCK_SIZE;
-    uint32_t blk_offset = offset % BLOCK_SIZE;
-    uint64_t inode_size;
-    size_t un_offset = (size_t)offset;
+    uint64_t pblock;
+    int err = 0;
 
-    struct inode *inode = inode_get(0, raw_inode);
-    if (!inode) {
+    if (it->lblock == lblock) {
+        return it->bh ? (uint8_t *)it->bh->b_data : NULL;
+    }
+
+    inode_dir_iter_release(it);
+    it->lblock = lblock;
+
+    pblock = dir_iter_map(it, lblock);
+    if (!pblock) {
         return NULL;
     }
-    inode_size = inode_get_size(inode);
-    inode_put(inode);
 
-    DEBUG("%zd/%"PRIu64"", un_offset, inode_size);
-    ASSERT(inode_size >= un_offset);
-    if (inode_size == un_offset) {
+    it->bh = fs_bread(pblock, &err);
+    if (!it->bh || err) {
+        err = err ? err : -EIO;
+        WARNING("Can't read block %u of directory %u: %d", lblock, it->inode->i_ino, err);
+        if (it->bh) fs_brelse(it->bh);
+        it->bh = NULL;
+        if (!it->err) it->err = err;
         return NULL;
     }
+    set_buffer_meta(it->bh);
 
-    if (lblock == ctx->lblock) {
-        return (struct ext4_dir_entry_2 *)&ctx->buf[blk_offset];
-    } else {
-        dir_ctx_update(raw_inode, lblock, ctx);
-        return inode_dentry_get(raw_inode, un_offset, ctx);
+    return (uint8_t *)it->bh->b_data;
+}
+
+/* Keeps the blocks a walk is about to get to under I/O, half a window ahead
+ * of lblock, a whole extent at a time where the walk goes that far.  The
+ * block being entered is submitted along, so a miss on it goes to the disk
+ * with the blocks that follow. */
+static void dir_iter_readahead(struct inode_dir_iter *it, uint32_t lblock)
+{
+    uint32_t window = MAX(DIR_RA_BYTES / BLOCK_SIZE, 1U);
+    uint32_t end = MIN(BYTES2BLOCKS(it->end), (uint64_t)lblock + window);
+    uint32_t next = MAX(it->ra_next, lblock);
+
+    /* Nothing ahead, or enough of it on its way already */
+    if (end <= lblock + 1 || next >= lblock + window / 2 + 1) {
+        return;
     }
+
+    while (next < end) {
+        uint64_t pblock = dir_iter_map(it, next);
+        uint32_t len = 1;
+
+        if (pblock) {
+            len = MIN(it->run_len - (next - it->run_lblock), end - next);
+            if (fs_breadahead(pblock, len) < (int)len) {
+                break;  /* The cache is full */
+            }
+        }
+        next += len;
+    }
+    it->ra_next = next;
 }
 
-int inode_get_by_number(uint32_t n, struct ext4_inode *inode)
+/* Returns the next entry in use, or NULL once the end is reached.  The entry
+ * points into the buffer the iterator holds, so it is only good until the
+ * next call, and it->pos is the offset right after it.  Blocks that can't
+ * be read or are corrupted are skipped, with it->err set. */
+struct ext4_dir_entry_2 *inode_dir_iter_next(struct inode_dir_iter *it)
+{
+    struct ext4_dir_entry_2 *dentry;
+    uint32_t blk_offset;
+    uint8_t *block;
+
+    while (it->pos < it->end) {
+        blk_offset = it->pos & (BLOCK_SIZE - 1);
+        if (it->pos / BLOCK_SIZE != it->lblock) {
+            dir_iter_readahead(it, it->pos / BLOCK_SIZE);
+        }
+        block = inode_dir_iter_block(it, it->pos / BLOCK_SIZE);
+        if (!block) {
+            /* A hole or a bad block, what follows may still be fine */
+            it->pos += BLOCK_SIZE - blk_offset;
+            continue;
+        }
+
+        dentry = (struct ext4_dir_entry_2 *)&block[blk_offset];
+        if (blk_offset > BLOCK_SIZE - EXT4_DIR_REC_LEN(0) ||
+            dentry->rec_len < EXT4_DIR_REC_LEN(dentry->name_len) ||
+            blk_offset + dentry->rec_len > BLOCK_SIZE) {
+            /* Corrupted, go on with the next block */
+            DEBUG("Bad rec_len %u at %"PRIu64"", dentry->rec_len, it->pos);
+            if (!it->err) it->err = -EIO;
+            it->pos += BLOCK_SIZE - blk_offset;
+            continue;
+        }
+        it->pos += dentry->rec_len;
+
+        /* It seems that is possible to have a dummy entry like this at the
+         * begining of a block of dentries.  Looks like skipping is the
+         * reasonable thing to do. */
+        if (dentry->inode) {
+            return dentry;
+        }
+    }
+
+    return NULL;
+}
+
+static off_t inode_disk_offset(uint32_t n)
 {
-    if (n == 0) return -ENOENT;
     n--;    /* Inode 0 doesn't exist on disk */
+    return super_group_inode_table_offset(n) + (off_t)(n % super_inodes_per_group()) * super_inode_size();
+}
+
+struct inode_read {
+    off_t off;
+    struct ext4_inode *inode;
+};
 
-    off_t off = super_group_inode_table_offset(n);
-    off += (n % super_inodes_per_group()) * super_inode_size();
+static int inode_read_cmp(const void *a, const void *b)
+{
+    off_t x = ((const struct inode_read *)a)->off;
+    off_t y = ((const struct inode_read *)b)->off;
+
+    return x < y ? -1 : x > y;
+}
 
+/* Reads the count inodes numbered n[] into inodes[].  They are read in the
+ * order they are laid out on the disk, and each inode table block is only
+ * looked up once for all the inodes it holds. */
+int inode_get_by_numbers(const uint32_t *n, int count, struct ext4_inode **inodes)
+{
     /* If on-disk inode is ext3 type, it will be smaller than the struct.  EXT4
      * inodes, on the other hand, are double size, but the struct still doesn't
      * have fields for all of them. */
-    disk_read(off, MIN(super_inode_size(), sizeof(struct ext4_inode)), inode);
-    return 0;
+    size_t size = MIN(super_inode_size(), sizeof(struct ext4_inode));
+    struct inode_read reads_short[16], *reads = reads_short;
+    struct buffer_head *bh = NULL;
+    uint64_t bh_block = 0;
+    int i, err = 0;
+
+    for (i = 0; i < count; i++) {
+        if (n[i] == 0) return -ENOENT;
+        if ((n[i] - 1) / super_inodes_per_group() >= super_n_block_groups()) {
+            WARNING("Inode %u out of range", n[i]);
+            return -EIO;
+        }
+    }
+
+    if (count > (int)(sizeof(reads_short) / sizeof(reads_short[0]))) {
+        reads = malloc(count * sizeof(*reads));
+        if (!reads) return -ENOMEM;
+    }
+
+    for (i = 0; i < count; i++) {
+        reads[i].off = inode_disk_offset(n[i]);
+        reads[i].inode = inodes[i];
+    }
+    qsort(reads, count, sizeof(*reads), inode_read_cmp);
+
+    /* Inodes never cross a block boundary */
+    for (i = 0; i < count; i++) {
+        uint64_t block = reads[i].off / BLOCK_SIZE;
+
+        if (!bh || block != bh_block) {
+            if (bh) fs_brelse(bh);
+            bh = fs_bread(block, &err);
+            if (!bh) {
+                err = err ? err : -EIO;
+                break;
+            }
+            if (err) break;
+            set_buffer_meta(bh);
+            bh_block = block;
+        }
+        memcpy(reads[i].inode, bh->b_data + reads[i].off % BLOCK_SIZE, size);
+    }
+
+    if (bh) fs_brelse(bh);
+    if (reads != reads_short) free(reads);
+    return err;
+}
+
+int inode_get_by_number(uint32_t n, struct ext4_inode *inode)
+{
+    return inode_get_by_numbers(&n, 1, &inode);
 }
 
 int inode_set_by_number(uint32_t n, struct ext4_inode *inode)
 {
     if (n == 0) return -ENOENT;
-    n--;    /* Inode 0 doesn't exist on disk */
 
-    off_t off = super_group_inode_table_offset(n);
-    off += (n % super_inodes_per_group()) * super_inode_size();
+    off_t off = inode_disk_offset(n);
 
     /* If on-disk inode is ext3 type, it will be smaller than the struct.  EXT4
      * inodes, on the other hand, are double size, but the struct still doesn't
@@ -197,25 +371,42 @@ static uint8_t get_path_token_len(const char *path)
     return len;
 }
 
-static struct dcache_entry *get_cached_inode_num(const char **path)
+/* A name whose type is unknown might still be a directory */
+static inline int may_be_dir(uint8_t file_type)
 {
-    struct dcache_entry *next = NULL;
-    struct dcache_entry *ret;
+    return file_type == EXT4_FT_DIR || file_type == EXT4_FT_UNKNOWN;
+}
 
-    do {
+/* Follows the path as far as it is cached, leaving it at the first token not
+ * found in the dcache.  Returns the inode number reached, or 0 if the dcache
+ * knows a token doesn't exist. */
+static uint32_t get_cached_inode_num(const char **path)
+{
+    uint32_t inode_idx = ROOT_INODE_N;
+    uint8_t file_type = EXT4_FT_DIR;
+
+    for (;;) {
         if (**path == '/') *path = *path + 1; /* Skip over the slash */
         uint8_t path_len = get_path_token_len(*path);
-        ret = next;
 
         if (path_len == 0) {
-            return ret;
+            return inode_idx;
+        }
+        if (!may_be_dir(file_type)) {
+            return 0;
         }
 
-        next = dcache_lookup(ret, *path, path_len);
-        if (next) *path += path_len;
-    } while(next != NULL);
+        uint32_t next;
+        if (!dcache_lookup(inode_idx, *path, path_len, &next, &file_type)) {
+            return inode_idx;
+        }
+        if (!next) {
+            return 0;
+        }
 
-    return ret;
+        inode_idx = next;
+        *path += path_len;
+    }
 }
 
 static const char *skip_trailing_backslash(const char *path)
@@ -224,48 +415,107 @@ static const char *skip_trailing_backslash(const char *path)
     return path;
 }
 
+/* Looks name up among the entries the iterator has left.  The entry
+ * returned lives in the block it holds. */
+static struct ext4_dir_entry_2 *dir_scan(struct inode_dir_iter *it, const char *name, int len)
+{
+    struct ext4_dir_entry_2 *dentry;
+
+    while ((dentry = inode_dir_iter_next(it))) {
+        if (len != dentry->name_len) continue;
+        if (memcmp(name, dentry->name, dentry->name_len)) continue;
+
+        return dentry;
+    }
+
+    return NULL;
+}
+
+/* Looks name up in dir.  Indexed directories only have the leaf blocks the
+ * name hashes to scanned, others are scanned whole.  it is left holding the
+ * block of the entry returned, and has to be released either way.  If NULL
+ * is returned with it->err set, some of the blocks couldn't be looked at
+ * and the name may still exist. */
+static struct ext4_dir_entry_2 *dir_find_entry(struct inode *dir, const char *name, int len,
+                                               struct inode_dir_iter *it)
+{
+    struct ext4_dir_entry_2 *dentry;
+    struct htree_path hpath;
+    uint32_t lblock;
+    int ret;
+
+    inode_dir_iter_start(it, dir);
+
+    ret = htree_find_leaf(it, name, len, &hpath, &lblock);
+    if (ret == 0) {
+        do {
+            inode_dir_iter_seek(it, BLOCKS2BYTES(lblock), BLOCKS2BYTES(lblock + 1));
+            dentry = dir_scan(it, name, len);
+            if (dentry) return dentry;
+        } while ((ret = htree_next_leaf(it, &hpath, &lblock)) > 0);
+
+        if (ret == 0) return NULL;
+    }
+    /* A broken index leaves the leaves it points to in doubt */
+    if (ret == -EIO && !it->err) it->err = ret;
+
+    /* Not indexed, or the index is of no use */
+    inode_dir_iter_seek(it, 0, inode_get_size(dir));
+    return dir_scan(it, name, len);
+}
+
 uint32_t inode_get_idx_by_path(const char *path)
 {
-    struct inode_dir_ctx *dctx = inode_dir_ctx_get();
+    struct inode_dir_iter it;
     uint32_t inode_idx = 0;
-    struct ext4_inode inode;
+    uint8_t file_type = EXT4_FT_DIR;
+    struct inode *inode;
 
     /* Paths from fuse are always absolute */
     assert(IS_PATH_SEPARATOR(path[0]));
 
     DEBUG("Looking up: %s", path);
 
-    struct dcache_entry *dc_entry = get_cached_inode_num(&path);
-    inode_idx = dcache_get_inode(dc_entry);
+    inode_idx = get_cached_inode_num(&path);
+    if (!inode_idx) {
+        DEBUG("Negative dcache entry in: %s", path);
+        return 0;
+    }
 
     DEBUG("Looking up after dcache: %s", path);
 
     do {
-        uint32_t offset = 0;
-        struct ext4_dir_entry_2 *dentry = NULL;
+        struct ext4_dir_entry_2 *dentry;
 
         path = skip_trailing_backslash(path);
         uint8_t path_len = get_path_token_len(path);
 
         if (path_len == 0) break;
-        inode_get_by_number(inode_idx, &inode);
-
-        inode_dir_ctx_reset(dctx, &inode);
-        while ((dentry = inode_dentry_get(&inode, offset, dctx))) {
-            offset += dentry->rec_len;
-
-            if (!dentry->inode) continue;
-            if (path_len != dentry->name_len) continue;
-            if (memcmp(path, dentry->name, dentry->name_len)) continue;
+        if (!may_be_dir(file_type)) {
+            inode_idx = 0;
+            break;
+        }
+        inode = inode_get(inode_idx, NULL);
+        if (!inode) {
+            inode_idx = 0;
+            break;
+        }
+        inode_lock_shared(inode);
 
+        dentry = dir_find_entry(inode, path, path_len, &it);
+        if (dentry) {
             inode_idx = dentry->inode;
+            file_type = dentry->file_type;
             DEBUG("Lookup following inode %d", inode_idx);
 
-            if (S_ISDIR(inode.i_mode)) {
-                dc_entry = dcache_insert(dc_entry, path, path_len, inode_idx);
-            }
-            break;
+            dcache_insert(inode->i_ino, path, path_len, inode_idx, file_type);
+        } else if (!it.err) {
+            /* Remember the name doesn't exist until somebody creates it */
+            dcache_insert(inode->i_ino, path, path_len, 0, EXT4_FT_UNKNOWN);
         }
+        inode_dir_iter_release(&it);
+        inode_unlock(inode);
+        inode_put(inode);
 
         /* Couldn't find the entry at all */
         if (dentry == NULL) {
@@ -274,16 +524,24 @@ uint32_t inode_get_idx_by_path(const char *path)
         }
     } while((path = strchr(path, '/')));
 
-    inode_dir_ctx_put(dctx);
     return inode_idx;
 }
 
-int inode_get_by_path(const char *path, struct ext4_inode *inode)
+struct inode *inode_get_by_path(const char *path, int *ret)
 {
-    return inode_get_by_number(inode_get_idx_by_path(path), inode);
+    return inode_get(inode_get_idx_by_path(path), ret);
 }
 
 int inode_init(void)
 {
-    return dcache_init_root(ROOT_INODE_N);
+    if (dcache_init() != 0) {
+        return -1;
+    }
+    return icache_init();
+}
+
+void inode_uninit(void)
+{
+    icache_uninit();
+    dcache_uninit();
 }
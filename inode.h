@@ -7,9 +7,22 @@
 #include "types/ext4_dentry.h"
 #include "inode_in-memory.h"
 
-struct inode_dir_ctx {
-    uint32_t lblock;        /* Currently buffered lblock */
-    uint8_t buf[];
+struct buffer_head;
+
+/* Walks the entries of a directory.  The inode is pinned, and locked at
+ * least shared, by whoever starts the iterator until it is released. */
+struct inode_dir_iter {
+    struct inode *inode;
+    uint64_t pos;           /* Offset of the next entry */
+    uint64_t end;           /* Offset the walk stops at */
+    uint32_t lblock;        /* lblock whose buffer is held */
+    struct buffer_head *bh;
+    uint32_t run_lblock;    /* Mapping of the extent lblock was found in */
+    uint32_t run_len;
+    uint64_t run_pblock;
+    unsigned long run_gen;
+    uint32_t ra_next;       /* First lblock not read ahead yet */
+    int err;                /* First block the walk couldn't use */
 };
 
 static inline uint64_t inode_get_size(struct inode *inode)
@@ -20,16 +33,19 @@ static inline uint64_t inode_get_size(struct inode *inode)
 uint64_t inode_get_data_pblock(struct inode *inode, uint32_t lblock, uint32_t *extent_len, int create);
 int inode_remove_data_pblock(struct inode *inode, ext4_lblk_t from);
 
-struct inode_dir_ctx *inode_dir_ctx_get(void);
-void inode_dir_ctx_put(struct inode_dir_ctx *);
-void inode_dir_ctx_reset(struct inode_dir_ctx *ctx, struct ext4_inode *inode);
-struct ext4_dir_entry_2 *inode_dentry_get(struct ext4_inode *raw_inode, off_t offset, struct inode_dir_ctx *ctx);
+void inode_dir_iter_start(struct inode_dir_iter *it, struct inode *inode);
+void inode_dir_iter_release(struct inode_dir_iter *it);
+void inode_dir_iter_seek(struct inode_dir_iter *it, uint64_t start, uint64_t end);
+uint8_t *inode_dir_iter_block(struct inode_dir_iter *it, uint32_t lblock);
+struct ext4_dir_entry_2 *inode_dir_iter_next(struct inode_dir_iter *it);
 
 int inode_get_by_number(uint32_t n, struct ext4_inode *inode);
+int inode_get_by_numbers(const uint32_t *n, int count, struct ext4_inode **inodes);
 int inode_set_by_number(uint32_t n, struct ext4_inode *inode);
-int inode_get_by_path(const char *path, struct ext4_inode *inode);
+struct inode *inode_get_by_path(const char *path, int *ret);
 uint32_t inode_get_idx_by_path(const char *path);
 
 int inode_init(void);
+void inode_uninit(void);
 
 #endif
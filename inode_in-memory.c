@@ -1,25 +1,439 @@
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
 
+#include "common.h"
+#include "buffer.h"
 #include "inode.h"
+#include "logging.h"
 
-struct inode *inode_get(uint32_t ino, struct ext4_inode *raw_inode)
+/*
+ * The inode cache: inodes in use and up to ICACHE_MAX_UNUSED unused
+ * ones, hashed by inode number.  Changes to the inodes are written back
+ * once they are evicted from the cache, once they have been dirty for
+ * the dirty_expire of the buffer cache, or on unmount.
+ */
+#define ICACHE_HASH_SIZE 1024
+
+/* How often the writeback thread looks for expired dirty inodes */
+#define ICACHE_WB_INTERVAL_MS 1000
+/* Inodes of a hash bucket written back at once at most */
+#define ICACHE_WB_BATCH 16
+
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode *icache_hash[ICACHE_HASH_SIZE];
+static LIST_HEAD(icache_lru);
+static unsigned long icache_nr_unused;
+
+/* Signalled, with icache_lock, when inodes leave I_NEW or I_FREEING */
+static pthread_cond_t icache_state_wait = PTHREAD_COND_INITIALIZER;
+
+static pthread_t icache_wb_thread;
+static pthread_cond_t icache_wb_wait = PTHREAD_COND_INITIALIZER;
+static int icache_wb_running, icache_wb_exiting;
+
+unsigned long inode_ext_gen_seq;
+
+static inline struct inode **icache_bucket(uint32_t ino)
+{
+	return &icache_hash[ino % ICACHE_HASH_SIZE];
+}
+
+/* Called with icache_lock held. */
+static struct inode *icache_find(uint32_t ino)
+{
+	struct inode *inode = *icache_bucket(ino);
+
+	while (inode && inode->i_ino != ino)
+		inode = inode->i_hash_next;
+	return inode;
+}
+
+/* Called with icache_lock held. */
+static void icache_unhash(struct inode *inode)
+{
+	struct inode **p = icache_bucket(inode->i_ino);
+
+	while (*p != inode)
+		p = &(*p)->i_hash_next;
+	*p = inode->i_hash_next;
+}
+
+unsigned long icache_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void inode_writeback(struct inode *inode)
+{
+	if (inode->i_data_dirty) {
+		inode_set_by_number(inode->i_ino, inode->raw_inode);
+		inode->i_data_dirty = 0;
+	}
+}
+
+static void inode_free(struct inode *inode)
+{
+	ext4_es_free_tree(&inode->i_es_tree);
+	pthread_rwlock_destroy(&inode->i_lock);
+	free(inode);
+}
+
+/*
+ * Called with icache_lock held, which is dropped while @inode, unused
+ * and off the LRU, is written back.  It stays hashed as I_FREEING
+ * meanwhile, and inode_get() waits for it to be gone before reading it
+ * again: the copy on the disk is only good once the write is in the
+ * buffer cache.
+ */
+static void icache_evict(struct inode *inode)
+{
+	inode->i_state |= I_FREEING;
+	if (inode->i_data_dirty) {
+		pthread_mutex_unlock(&icache_lock);
+		inode_writeback(inode);
+		pthread_mutex_lock(&icache_lock);
+	}
+	icache_unhash(inode);
+	pthread_cond_broadcast(&icache_state_wait);
+	inode_free(inode);
+}
+
+/*
+ * Called with icache_lock held, see icache_evict().  Evict the oldest
+ * unused inodes while there are too many.
+ */
+static void icache_shrink(void)
+{
+	while (icache_nr_unused > ICACHE_MAX_UNUSED) {
+		struct inode *inode = list_first_entry(&icache_lru,
+						       struct inode, i_lru);
+
+		list_del_init(&inode->i_lru);
+		icache_nr_unused--;
+		icache_evict(inode);
+	}
+}
+
+static void inode_init_new(struct inode *inode, uint32_t ino)
 {
-	struct inode *inode = malloc(sizeof(struct inode));
-	if (!inode || !raw_inode)
-		return NULL;
 	inode->i_ino = ino;
 	inode->i_data_dirty = 0;
-	inode->raw_inode = raw_inode;
+	inode->raw_inode = &inode->i_raw;
+	inode->i_ext_gen = __sync_add_and_fetch(&inode_ext_gen_seq, 1);
+	inode->i_count = 0;
+	inode->i_state = 0;
+	INIT_LIST_HEAD(&inode->i_lru);
+	pthread_rwlock_init(&inode->i_lock, NULL);
+	ext4_es_init_tree(&inode->i_es_tree);
+}
+
+/* Called with icache_lock held. */
+static void icache_hash_add(struct inode *inode)
+{
+	inode->i_hash_next = *icache_bucket(inode->i_ino);
+	*icache_bucket(inode->i_ino) = inode;
+}
+
+/* Called with icache_lock held. */
+static void __inode_get(struct inode *inode)
+{
+	if (!inode->i_count++ && !list_empty(&inode->i_lru)) {
+		list_del_init(&inode->i_lru);
+		icache_nr_unused--;
+	}
+}
+
+/* Called with icache_lock held, which may be dropped, see icache_evict(). */
+static void __inode_put(struct inode *inode)
+{
+	ASSERT(inode->i_count > 0);
+	if (--inode->i_count)
+		return;
+
+	/* Failed reads are unhashed already, and have nothing to write */
+	if (inode->i_state & I_BAD) {
+		inode_free(inode);
+		return;
+	}
+	list_add_tail(&inode->i_lru, &icache_lru);
+	icache_nr_unused++;
+	icache_shrink();
+}
+
+/*
+ * Called with icache_lock held, once the read of an I_NEW inode is
+ * done, successfully unless @err.  Those waiting for it are woken up.
+ */
+static void icache_new_done(struct inode *inode, int err)
+{
+	inode->i_state &= ~I_NEW;
+	if (err) {
+		inode->i_state |= I_BAD;
+		icache_unhash(inode);
+	}
+	pthread_cond_broadcast(&icache_state_wait);
+}
+
+/*
+ * Get a reference to inode @ino, reading it from the disk unless it is
+ * cached already.  On failure NULL is returned, and the error in @ret.
+ *
+ * An inode is hashed, as I_NEW, before it is read, and whoever looks
+ * it up meanwhile waits for the read.  One being evicted is waited for
+ * until it is gone.  So only one copy of it is ever cached, and never
+ * one read before the last writeback.
+ */
+struct inode *inode_get(uint32_t ino, int *ret)
+{
+	struct inode *inode, *new = NULL;
+	int err;
+
+	pthread_mutex_lock(&icache_lock);
+	for (;;) {
+		inode = icache_find(ino);
+		if (inode && inode->i_state & I_FREEING) {
+			pthread_cond_wait(&icache_state_wait, &icache_lock);
+			continue;
+		}
+		if (inode || new)
+			break;
+
+		pthread_mutex_unlock(&icache_lock);
+		new = malloc(sizeof(struct inode));
+		if (!new) {
+			err = -ENOMEM;
+			goto err;
+		}
+		pthread_mutex_lock(&icache_lock);
+	}
+
+	if (inode) {
+		free(new);
+		__inode_get(inode);
+		while (inode->i_state & I_NEW)
+			pthread_cond_wait(&icache_state_wait, &icache_lock);
+		if (inode->i_state & I_BAD) {
+			__inode_put(inode);
+			pthread_mutex_unlock(&icache_lock);
+			err = -EIO;
+			goto err;
+		}
+		pthread_mutex_unlock(&icache_lock);
+		goto out;
+	}
+
+	inode = new;
+	inode_init_new(inode, ino);
+	inode->i_state = I_NEW;
+	inode->i_count = 1;
+	icache_hash_add(inode);
+	pthread_mutex_unlock(&icache_lock);
+
+	err = inode_get_by_number(ino, inode->raw_inode);
+
+	pthread_mutex_lock(&icache_lock);
+	icache_new_done(inode, err);
+	if (err < 0) {
+		__inode_put(inode);
+		pthread_mutex_unlock(&icache_lock);
+		goto err;
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+out:
+	if (ret)
+		*ret = 0;
 	return inode;
+
+err:
+	if (ret)
+		*ret = err;
+	return NULL;
 }
 
 void inode_put(struct inode *inode)
 {
-	if (inode->i_data_dirty) {
-		if (inode->i_ino)
-			inode_set_by_number(inode->i_ino, inode->raw_inode);
+	pthread_mutex_lock(&icache_lock);
+	__inode_put(inode);
+	pthread_mutex_unlock(&icache_lock);
+}
 
-		inode->i_data_dirty = 0;
+/*
+ * Read those of the @count inodes @ino that aren't cached into the
+ * cache, as unused inodes, ahead of inode_get() asking for them.  The
+ * inode table blocks are read once for all the inodes in them.  Only
+ * ICACHE_PREFETCH_MAX inodes are looked at, and failures are ignored.
+ *
+ * The inodes are hashed as I_NEW before they are read, like inode_get()
+ * does, so a lookup meanwhile waits for them.
+ */
+void inode_prefetch(const uint32_t *ino, int count)
+{
+	struct ext4_inode *raw[ICACHE_PREFETCH_MAX];
+	struct inode *new[ICACHE_PREFETCH_MAX];
+	uint32_t n[ICACHE_PREFETCH_MAX];
+	int i, err, ret = 0, nr = 0, nr_alloc;
+
+	count = MIN(count, ICACHE_PREFETCH_MAX);
+	for (nr_alloc = 0; nr_alloc < count; nr_alloc++) {
+		new[nr_alloc] = malloc(sizeof(struct inode));
+		if (!new[nr_alloc])
+			break;
 	}
-	free(inode);
+
+	/* A name listed twice is found the second time */
+	pthread_mutex_lock(&icache_lock);
+	for (i = 0; i < count && nr < nr_alloc; i++) {
+		struct inode *inode;
+
+		if (!ino[i] || icache_find(ino[i]))
+			continue;
+		inode = new[nr];
+		inode_init_new(inode, ino[i]);
+		inode->i_state = I_NEW;
+		inode->i_count = 1;
+		icache_hash_add(inode);
+		n[nr] = ino[i];
+		raw[nr++] = inode->raw_inode;
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	for (i = nr; i < nr_alloc; i++)
+		free(new[i]);
+	if (!nr)
+		return;
+
+	/*
+	 * The batch fails as a whole, read them one by one then: a lookup
+	 * waiting on one of them mustn't fail because of another.
+	 */
+	err = inode_get_by_numbers(n, nr, raw);
+
+	pthread_mutex_lock(&icache_lock);
+	for (i = 0; i < nr; i++) {
+		if (err < 0) {
+			pthread_mutex_unlock(&icache_lock);
+			ret = inode_get_by_number(n[i], raw[i]);
+			pthread_mutex_lock(&icache_lock);
+		}
+		icache_new_done(new[i], err < 0 ? ret : 0);
+		__inode_put(new[i]);
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+/*
+ * Write back the inodes dirty since before @dirtied_before (in
+ * icache_now_ms() time).  icache_lock is only held to pin the inodes of
+ * a hash bucket, not while they are written.  Inodes that are being
+ * changed right now are left for the next round.
+ */
+static void icache_writeback_expired(unsigned long dirtied_before)
+{
+	struct inode *batch[ICACHE_WB_BATCH];
+	int i, j, nr;
+
+	for (i = 0; i < ICACHE_HASH_SIZE; i++) {
+		struct inode *inode;
+
+		nr = 0;
+		pthread_mutex_lock(&icache_lock);
+		for (inode = icache_hash[i]; inode && nr < ICACHE_WB_BATCH;
+		     inode = inode->i_hash_next) {
+			if (!inode->i_data_dirty ||
+			    inode->i_state & (I_NEW | I_FREEING) ||
+			    (long)(dirtied_before - inode->i_dirtied_ms) < 0)
+				continue;
+			__inode_get(inode);
+			batch[nr++] = inode;
+		}
+		pthread_mutex_unlock(&icache_lock);
+		if (!nr)
+			continue;
+
+		for (j = 0; j < nr; j++) {
+			if (pthread_rwlock_tryrdlock(&batch[j]->i_lock))
+				continue;
+			inode_writeback(batch[j]);
+			inode_unlock(batch[j]);
+		}
+
+		pthread_mutex_lock(&icache_lock);
+		for (j = 0; j < nr; j++)
+			__inode_put(batch[j]);
+		pthread_mutex_unlock(&icache_lock);
+	}
+}
+
+/*
+ * Dirty buffers are written back once they are dirty_expire old, do the
+ * same for inodes so that a change doesn't sit in memory until the
+ * inode gets evicted.
+ */
+static void *icache_writeback_thread(void *arg)
+{
+	unsigned long expire_ms = fs_cache_dirty_expire() * 1000UL;
+	struct timespec ts;
+
+	UNUSED(arg);
+	pthread_mutex_lock(&icache_lock);
+	while (!icache_wb_exiting) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ICACHE_WB_INTERVAL_MS / 1000;
+		pthread_cond_timedwait(&icache_wb_wait, &icache_lock, &ts);
+		if (icache_wb_exiting)
+			break;
+		pthread_mutex_unlock(&icache_lock);
+		icache_writeback_expired(icache_now_ms() - expire_ms);
+		pthread_mutex_lock(&icache_lock);
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return NULL;
+}
+
+int icache_init(void)
+{
+	icache_wb_exiting = 0;
+	if (pthread_create(&icache_wb_thread, NULL, icache_writeback_thread,
+			   NULL))
+		return -1;
+	icache_wb_running = 1;
+	return 0;
+}
+
+/*
+ * Write back and drop all the cached inodes.
+ */
+void icache_uninit(void)
+{
+	int i;
+
+	if (icache_wb_running) {
+		pthread_mutex_lock(&icache_lock);
+		icache_wb_exiting = 1;
+		pthread_cond_signal(&icache_wb_wait);
+		pthread_mutex_unlock(&icache_lock);
+		pthread_join(icache_wb_thread, NULL);
+		icache_wb_running = 0;
+	}
+
+	pthread_mutex_lock(&icache_lock);
+	for (i = 0; i < ICACHE_HASH_SIZE; i++) {
+		while (icache_hash[i]) {
+			struct inode *inode = icache_hash[i];
+
+			if (inode->i_count)
+				WARNING("Inode %u still in use", inode->i_ino);
+			icache_hash[i] = inode->i_hash_next;
+			inode_writeback(inode);
+			inode_free(inode);
+		}
+	}
+	INIT_LIST_HEAD(&icache_lru);
+	icache_nr_unused = 0;
+	pthread_mutex_unlock(&icache_lock);
 }
@@ -1,21 +1,87 @@
 #ifndef INODE_IN_MEMORY_H
 #define INODE_IN_MEMORY_H
 
+#include <pthread.h>
+
+#include "types/list.h"
+#include "extents/extents_status.h"
+
 #define i_data raw_inode->i_block
 
+/* i_state bits */
+#define I_NEW	(1 << 0)	/* being read from the disk */
+#define I_BAD	(1 << 1)	/* could not be read, unhashed */
+#define I_FREEING (1 << 2)	/* being written back and evicted */
+
+/*
+ * Inodes are cached, see inode_get().  i_count, i_state, i_hash_next
+ * and i_lru are protected by the cache lock, the rest by i_lock, which
+ * is held shared to look at the inode and exclusively to change it.
+ */
 struct inode {
 	int i_data_dirty;
+	unsigned long i_dirtied_ms;	/* when i_data_dirty got set */
 	uint32_t i_ino;
 	struct ext4_inode *raw_inode;
+
+	unsigned long i_ext_gen;	/* changes whenever the extents change */
+	struct ext4_es_tree i_es_tree;	/* has a lock of its own */
+
+	int i_count;
+	int i_state;
+	struct inode *i_hash_next;
+	struct list_head i_lru;		/* unused inodes, oldest first */
+	pthread_rwlock_t i_lock;
+
+	struct ext4_inode i_raw;
 };
 
-struct inode *inode_get(uint32_t ino, struct ext4_inode *raw_inode);
+/* Unused inodes kept cached at most */
+#define ICACHE_MAX_UNUSED 1024
+
+/* Inodes inode_prefetch() reads at once at most */
+#define ICACHE_PREFETCH_MAX 64
+
+unsigned long icache_now_ms(void);
+
+struct inode *inode_get(uint32_t ino, int *ret);
 static inline void inode_mark_dirty(struct inode *inode)
 {
+	if (!inode->i_data_dirty)
+		inode->i_dirtied_ms = icache_now_ms();
 	inode->i_data_dirty = 1;
 }
 
+extern unsigned long inode_ext_gen_seq;
+
+/*
+ * Called with the inode locked exclusively.  Generations are never
+ * reused, not even by another inode cached at the same address.
+ */
+static inline void inode_extents_changed(struct inode *inode)
+{
+	inode->i_ext_gen = __sync_add_and_fetch(&inode_ext_gen_seq, 1);
+}
+
 void inode_put(struct inode *inode);
+void inode_prefetch(const uint32_t *ino, int count);
+int icache_init(void);
+void icache_uninit(void);
+
+static inline void inode_lock(struct inode *inode)
+{
+	pthread_rwlock_wrlock(&inode->i_lock);
+}
+
+static inline void inode_lock_shared(struct inode *inode)
+{
+	pthread_rwlock_rdlock(&inode->i_lock);
+}
+
+static inline void inode_unlock(struct inode *inode)
+{
+	pthread_rwlock_unlock(&inode->i_lock);
+}
 
 static inline void inode_set_size(struct inode *inode, uint64_t size)
 {
@@ -18,39 +18,36 @@
 
 int op_getattr(const char *path, struct stat *stbuf)
 {
-    struct ext4_inode raw_inode;
+    struct ext4_inode *raw_inode;
     struct inode *inode;
     int ret = 0;
-    uint64_t size;
 
     DEBUG("getattr(%s)", path);
 
     memset(stbuf, 0, sizeof(struct stat));
-    ret = inode_get_by_path(path, &raw_inode);
+    inode = inode_get_by_path(path, &ret);
 
-    if (ret < 0) {
+    if (!inode) {
         return ret;
     }
 
-    inode = inode_get(0, &raw_inode);
-    if (!inode)
-        return -ENOMEM;
+    inode_lock_shared(inode);
+    raw_inode = inode->raw_inode;
 
-    size = inode_get_size(inode);
-    inode_put(inode);
+    stbuf->st_mode = raw_inode->i_mode;
+    stbuf->st_nlink = raw_inode->i_links_count;
+    stbuf->st_size = inode_get_size(inode);
+    stbuf->st_blocks = raw_inode->i_blocks_lo;
+    stbuf->st_uid = raw_inode->i_uid;
+    stbuf->st_gid = raw_inode->i_gid;
+    stbuf->st_atime = raw_inode->i_atime;
+    stbuf->st_mtime = raw_inode->i_mtime;
+    stbuf->st_ctime = raw_inode->i_ctime;
 
+    inode_unlock(inode);
+    inode_put(inode);
 
     DEBUG("getattr done");
 
-    stbuf->st_mode = raw_inode.i_mode;
-    stbuf->st_nlink = raw_inode.i_links_count;
-    stbuf->st_size = size;
-    stbuf->st_blocks = raw_inode.i_blocks_lo;
-    stbuf->st_uid = raw_inode.i_uid;
-    stbuf->st_gid = raw_inode.i_gid;
-    stbuf->st_atime = raw_inode.i_atime;
-    stbuf->st_mtime = raw_inode.i_mtime;
-    stbuf->st_ctime = raw_inode.i_ctime;
-
     return 0;
 }
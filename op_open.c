@@ -12,15 +12,26 @@
 
 #include "common.h"
 #include "inode.h"
+#include "file.h"
 #include "logging.h"
 #include "ops.h"
 
 int op_open(const char *path, struct fuse_file_info *fi)
 {   
+    struct e4f_file *file;
+    uint32_t ino;
+    int ret;
+
     DEBUG("open");
 
-    fi->fh = inode_get_idx_by_path(path);
-    DEBUG("%s is inode %d", path, fi->fh);
+    ino = inode_get_idx_by_path(path);
+    DEBUG("%s is inode %d", path, ino);
+
+    file = file_open(ino, &ret);
+    if (!file) {
+        return ret;
+    }
 
+    fi->fh = (uintptr_t)file;
     return 0;
 }
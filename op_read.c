@@ -17,6 +17,7 @@
 #include "disk.h"
 #include "super.h"
 #include "inode.h"
+#include "file.h"
 #include "logging.h"
 #include "ops.h"
 
@@ -41,7 +42,7 @@ static size_t truncate_size(struct inode *inode, size_t size, size_t offset)
 }
 
 /* This function reads all necessary data until the offset is aligned */
-static size_t first_read(struct inode *inode, char *buf, size_t size, off_t offset)
+static size_t first_read(struct e4f_file *file, char *buf, size_t size, off_t offset)
 {
     /* Reason for the -1 is that offset = 0 and size = BLOCK_SIZE is all on the
      * same block.  Meaning that byte at offset + size is not actually read. */
@@ -53,7 +54,7 @@ static size_t first_read(struct inode *inode, char *buf, size_t size, off_t offs
     if (size == 0) return 0;
     if (start_block_off == 0) return 0;
 
-    uint64_t start_pblock = inode_get_data_pblock(inode, start_lblock, NULL, 0);
+    uint64_t start_pblock = file_get_data_pblock(file, start_lblock, NULL, 0);
 
     /* Check if all the read request lays on the same block */
     if (start_lblock == end_lblock) {
@@ -71,34 +72,30 @@ static size_t first_read(struct inode *inode, char *buf, size_t size, off_t offs
 int op_read(const char *path, char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi)
 {
-    struct ext4_inode raw_inode;
-    struct inode *inode;
+    struct e4f_file *file = FI_FILE(fi);
+    struct inode *inode = file->f_inode;
     size_t ret = 0;
-    uint32_t extent_len, ino;
+    uint32_t extent_len;
 
     /* Not sure if this is possible at all... */
     ASSERT(offset >= 0);
 
-    DEBUG("read(%s, buf, %zd, %llu, fi->fh=%d)", path, size, offset, fi->fh);
-    ino = fi->fh;
-    int inode_get_ret = inode_get_by_number(fi->fh, &raw_inode);
+    DEBUG("read(%s, buf, %zd, %llu, inode %u)", path, size, offset, inode->i_ino);
+    inode_lock_shared(inode);
 
-    if (inode_get_ret < 0) {
-        return inode_get_ret;
-    }
+    size = truncate_size(inode, size, offset);
 
-    inode = inode_get(ino, &raw_inode);
-    if (!inode)
-        return -ENOMEM;
+    /* The blocks read, for readahead */
+    uint32_t ra_lblock = offset / BLOCK_SIZE;
+    uint32_t ra_nr = size ? (offset + size - 1) / BLOCK_SIZE - ra_lblock + 1 : 0;
 
-    size = truncate_size(inode, size, offset);
-    ret = first_read(inode, buf, size, offset);
+    ret = first_read(file, buf, size, offset);
 
     buf += ret;
     offset += ret;
 
     for (unsigned int lblock = offset / BLOCK_SIZE; size > ret; lblock += extent_len) {
-        uint64_t pblock = inode_get_data_pblock(inode, lblock, &extent_len, 0);
+        uint64_t pblock = file_get_data_pblock(file, lblock, &extent_len, 0);
         size_t bytes;
 
         if (pblock) {
@@ -116,7 +113,9 @@ int op_read(const char *path, char *buf, size_t size, off_t offset,
         DEBUG("Read %zd/%zd bytes from %d consecutive blocks", ret, size, extent_len);
     }
 
-    inode_put(inode);
+    file_ra_read(file, ra_lblock, ra_nr);
+
+    inode_unlock(inode);
 
     /* We always read as many bytes as requested (after initial truncation) */
     ASSERT(size == ret);
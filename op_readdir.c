@@ -9,9 +9,11 @@
 
 
 #include <string.h>
+#include <sys/stat.h>
 #include <fuse.h>
 
 #include "common.h"
+#include "dcache.h"
 #include "inode.h"
 #include "logging.h"
 
@@ -23,42 +25,86 @@ static char *get_printable_name(char *s, struct ext4_dir_entry_2 *entry)
     return s;
 }
 
+/* File type bits of st_mode for a dentry file_type, 0 if unknown */
+static mode_t get_dentry_mode(uint8_t file_type)
+{
+    static const mode_t modes[] = {
+        [EXT4_FT_REG_FILE]  = S_IFREG,
+        [EXT4_FT_DIR]       = S_IFDIR,
+        [EXT4_FT_CHRDEV]    = S_IFCHR,
+        [EXT4_FT_BLKDEV]    = S_IFBLK,
+        [EXT4_FT_FIFO]      = S_IFIFO,
+        [EXT4_FT_SOCK]      = S_IFSOCK,
+        [EXT4_FT_SYMLINK]   = S_IFLNK,
+    };
+
+    return file_type < sizeof(modes) / sizeof(modes[0]) ? modes[file_type] : 0;
+}
+
+static int is_dot_or_dotdot(struct ext4_dir_entry_2 *entry)
+{
+    return entry->name[0] == '.' &&
+           (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.'));
+}
+
 int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi)
 {
     DEBUG("readdir");
 
     UNUSED(fi);
-    char name_buf[EXT4_NAME_LEN];
+    char name_buf[EXT4_NAME_LEN + 1];
     struct ext4_dir_entry_2 *dentry = NULL;
-    struct ext4_inode inode;
+    struct inode_dir_iter it;
+    struct stat st;
+    uint32_t ino[ICACHE_PREFETCH_MAX];
+    int nr_ino = 0;
+    struct inode *inode;
+    int ret;
 
     /* We can use inode_get_by_number, but first we need to implement opendir */
-    int ret = inode_get_by_path(path, &inode);
+    inode = inode_get_by_path(path, &ret);
 
-    if (ret < 0) {
+    if (!inode) {
         return ret;
     }
 
-    struct inode_dir_ctx *dctx = inode_dir_ctx_get();
-    inode_dir_ctx_reset(dctx, &inode);
-    while ((dentry = inode_dentry_get(&inode, offset, dctx))) {
-        offset += dentry->rec_len;
-
-        if (!dentry->inode) {
-            /* It seems that is possible to have a dummy entry like this at the
-             * begining of a block of dentries.  Looks like skipping is the
-             * reasonable thing to do. */
-            continue;
-        }
+    inode_lock_shared(inode);
+    inode_dir_iter_start(&it, inode);
+    inode_dir_iter_seek(&it, offset, inode_get_size(inode));
+    memset(&st, 0, sizeof(st));
+    while ((dentry = inode_dir_iter_next(&it))) {
+        /* The high level API only passes the inode number and the type on
+         * to the kernel, both are in the dentry already */
+        st.st_ino = dentry->inode;
+        st.st_mode = get_dentry_mode(dentry->file_type);
 
         /* Providing offset to the filler function seems slower... */
         get_printable_name(name_buf, dentry);
         if (name_buf[0]) {
-            if (filler(buf, name_buf, NULL, offset) != 0) break;
+            if (filler(buf, name_buf, &st, it.pos) != 0) break;
+        }
+
+        /* Listing a directory is usually followed by a getattr of each of
+         * its entries, which then resolve from the dcache and the icache */
+        if (!is_dot_or_dotdot(dentry)) {
+            dcache_insert(inode->i_ino, dentry->name, dentry->name_len,
+                          dentry->inode, dentry->file_type);
+
+            /* Their inodes are read in batches, a block of the inode
+             * table at a time */
+            ino[nr_ino++] = dentry->inode;
+            if (nr_ino == ICACHE_PREFETCH_MAX) {
+                inode_prefetch(ino, nr_ino);
+                nr_ino = 0;
+            }
         }
     }
-    inode_dir_ctx_put(dctx);
+    inode_dir_iter_release(&it);
+    inode_unlock(inode);
+    inode_put(inode);
+
+    inode_prefetch(ino, nr_ino);
 
     return 0;
 }
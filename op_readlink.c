@@ -43,19 +43,24 @@ static int get_link_dest(struct inode *inode, char *buf, size_t bufsize)
 /* Check return values, bufer sizes and so on; strings are nasty... */
 int op_readlink(const char *path, char *buf, size_t bufsize)
 {
-    struct ext4_inode raw_inode;
+    struct inode *inode;
+    int ret;
     DEBUG("readlink");
 
-    inode_get_by_path(path, &raw_inode);
-    if (!S_ISLNK(raw_inode.i_mode)) {
-        return -EINVAL;
+    inode = inode_get_by_path(path, &ret);
+    if (!inode) {
+        return ret;
     }
 
-    struct inode *inode = inode_get(0, &raw_inode);
-    if (!inode)
-        return -ENOMEM;
+    inode_lock_shared(inode);
+    if (!S_ISLNK(inode->raw_inode->i_mode)) {
+        inode_unlock(inode);
+        inode_put(inode);
+        return -EINVAL;
+    }
 
     get_link_dest(inode, buf, bufsize);
+    inode_unlock(inode);
     inode_put(inode);
     DEBUG("Link resolved: %s => %s", path, buf);
     return 0;
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include "common.h"
+#include "file.h"
+#include "logging.h"
+#include "ops.h"
+
+int op_release(const char *path, struct fuse_file_info *fi)
+{
+    UNUSED(path);
+    DEBUG("release");
+
+    file_release(FI_FILE(fi));
+    fi->fh = 0;
+
+    return 0;
+}
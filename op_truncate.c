@@ -3,6 +3,7 @@
 #include "common.h"
 #include "super.h"
 #include "inode.h"
+#include "file.h"
 #include "logging.h"
 #include "ops.h"
 
@@ -10,7 +11,6 @@ int op_truncate (const char *path, off_t length)
 {
     int ret;
     uint32_t ino;
-    struct ext4_inode raw_inode;
     ext4_lblk_t from;
 
     ino = inode_get_idx_by_path(path);
@@ -18,16 +18,16 @@ int op_truncate (const char *path, off_t length)
         return -ENOENT;
     }
 
-    int inode_get_ret = inode_get_by_number(ino, &raw_inode);
-    if (inode_get_ret < 0) {
-        return inode_get_ret;
+    struct inode *inode = inode_get(ino, &ret);
+    if (!inode) {
+        return ret;
     }
 
-    struct inode *inode = inode_get(ino, &raw_inode);
-    ASSERT(inode);
+    inode_lock(inode);
     from = (length + super_block_size() - 1) / super_block_size();
     ret = inode_remove_data_pblock(inode, from);
     inode_set_size(inode, length);
+    inode_unlock(inode);
     inode_put(inode);
 
     return ret;
@@ -36,21 +36,14 @@ int op_truncate (const char *path, off_t length)
 int op_ftruncate (const char *path, off_t length, struct fuse_file_info *fi)
 {
     int ret;
-    uint32_t ino;
-    struct ext4_inode raw_inode;
     ext4_lblk_t from;
+    struct inode *inode = FI_FILE(fi)->f_inode;
 
-    int inode_get_ret = inode_get_by_number(ino = fi->fh, &raw_inode);
-    if (inode_get_ret < 0) {
-        return inode_get_ret;
-    }
-
-    struct inode *inode = inode_get(ino, &raw_inode);
-    ASSERT(inode);
+    inode_lock(inode);
     from = (length + super_block_size() - 1) / super_block_size();
     ret = inode_remove_data_pblock(inode, from);
     inode_set_size(inode, length);
-    inode_put(inode);
+    inode_unlock(inode);
 
     return ret;
 }
@@ -15,13 +15,15 @@
 
 #include "common.h"
 #include "disk.h"
+#include "buffer.h"
 #include "super.h"
 #include "inode.h"
+#include "file.h"
 #include "logging.h"
 #include "ops.h"
 
 /* This function write all necessary data until the offset is aligned */
-static size_t first_write(struct inode *inode, const char *buf, size_t size, off_t offset)
+static size_t first_write(struct e4f_file *file, const char *buf, size_t size, off_t offset)
 {
     /* Reason for the -1 is that offset = 0 and size = BLOCK_SIZE is all on the
      * same block.  Meaning that byte at offset + size is not actually read. */
@@ -33,7 +35,7 @@ static size_t first_write(struct inode *inode, const char *buf, size_t size, off
     if (size == 0) return 0;
     if (start_block_off == 0) return 0;
 
-    uint64_t start_pblock = inode_get_data_pblock(inode, start_lblock, NULL, 1);
+    uint64_t start_pblock = file_get_data_pblock(file, start_lblock, NULL, 1);
 
     /* Check if all the read request lays on the same block */
     if (start_lblock == end_lblock) {
@@ -51,30 +53,23 @@ static size_t first_write(struct inode *inode, const char *buf, size_t size, off
 int op_write(const char *path, const char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi)
 {
-    struct ext4_inode raw_inode;
-    struct inode *inode;
+    struct e4f_file *file = FI_FILE(fi);
+    struct inode *inode = file->f_inode;
     size_t ret = 0;
-    uint32_t extent_len, ino;
+    uint32_t extent_len;
     uint64_t orig_size;
 
     /* Not sure if this is possible at all... */
     ASSERT(offset >= 0);
 
-    DEBUG("write(%s, buf, %zd, %llu, fi->fh=%d)", path, size, offset, fi->fh);
-    ino = fi->fh;
-    int inode_get_ret = inode_get_by_number(ino, &raw_inode);
+    DEBUG("write(%s, buf, %zd, %llu, inode %u)", path, size, offset, inode->i_ino);
+    fs_balance_dirty();
 
-    if (inode_get_ret < 0) {
-        return inode_get_ret;
-    }
-
-    inode = inode_get(ino, &raw_inode);
-    if (!inode)
-        return -ENOMEM;
+    inode_lock(inode);
 
     orig_size = inode_get_size(inode);
 
-    ret = first_write(inode, buf, size, offset);
+    ret = first_write(file, buf, size, offset);
 
     buf += ret;
     offset += ret;
@@ -82,7 +77,7 @@ int op_write(const char *path, const char *buf, size_t size, off_t offset,
     for (ext4_lblk_t lblock = offset / BLOCK_SIZE; size > ret; lblock += extent_len) {
         uint64_t pblock;
         extent_len = (size - ret + super_block_size() - 1) / super_block_size();
-        pblock = inode_get_data_pblock(inode, lblock, &extent_len, ino);
+        pblock = file_get_data_pblock(file, lblock, &extent_len, 1);
         size_t bytes;
 
         if (pblock) {
@@ -102,7 +97,7 @@ int op_write(const char *path, const char *buf, size_t size, off_t offset,
     if ((off_t)orig_size < offset + ret)
         inode_set_size(inode, offset + ret);
 
-    inode_put(inode);
+    inode_unlock(inode);
 
     /* We always read as many bytes as requested (after initial truncation) */
     ASSERT(size == ret);
@@ -15,5 +15,6 @@ int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler
                                , off_t offset, struct fuse_file_info *fi);
 int op_getattr(const char *path, struct stat *stbuf);
 int op_open(const char *path, struct fuse_file_info *fi);
+int op_release(const char *path, struct fuse_file_info *fi);
 
 #endif
@@ -0,0 +1,96 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licens
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-
+ */
+
+/*
+ * On-demand sequential readahead of file data into the buffer cache.
+ */
+
+#include <pthread.h>
+
+#include "common.h"
+#include "super.h"
+#include "buffer.h"
+#include "logging.h"
+#include "file.h"
+#include "readahead.h"
+
+/*
+ * Start reading @nr blocks from @lblock without waiting, following the
+ * extent map.  Holes are skipped.
+ */
+static void ra_submit(struct inode *inode, uint32_t lblock, uint32_t nr)
+{
+	while (nr) {
+		uint32_t len;
+		uint64_t pblock = inode_get_data_pblock(inode, lblock, &len, 0);
+
+		if (!len)
+			len = 1;
+		len = MIN(len, nr);
+		if (pblock && fs_breadahead(pblock, len) < (int)len)
+			break;	/* the cache is full */
+
+		lblock += len;
+		nr -= len;
+	}
+}
+
+/*
+ * Called after blocks [@lblock, @lblock + @nr) of @file have been
+ * read.  A read that continues where the previous one stopped is
+ * sequential, as is the first read of a file.  The first sequential
+ * read submits a window of 4 * @nr blocks behind it, and every read
+ * that gets into the last window submits the next one, doubling the
+ * window size up to RA_MAX_BYTES.  Anything else resets the state.
+ */
+void file_ra_read(struct e4f_file *file, uint32_t lblock, uint32_t nr)
+{
+	struct file_ra_state *ra = &file->f_ra;
+	struct inode *inode = file->f_inode;
+	uint32_t end = lblock + nr;
+	uint32_t max = RA_MAX_BYTES / BLOCK_SIZE;
+	uint32_t eof = BYTES2BLOCKS(inode_get_size(inode));
+	uint32_t start = 0, size = 0;
+
+	if (!nr)
+		return;
+
+	pthread_mutex_lock(&file->f_lock);
+	if (lblock != ra->ra_prev && lblock != 0) {
+		ra->ra_size = 0;
+	} else if (!ra->ra_size) {
+		start = end;
+		size = MIN(4 * nr, max);
+	} else if (end > ra->ra_start) {
+		start = MAX(ra->ra_start + ra->ra_size, end);
+		size = MIN(2 * ra->ra_size, max);
+	}
+
+	if (size) {
+		ra->ra_start = start;
+		ra->ra_size = size;
+	}
+	ra->ra_prev = end;
+	pthread_mutex_unlock(&file->f_lock);
+
+	if (!size || start >= eof)
+		return;
+	if (size > eof - start)
+		size = eof - start;
+
+	DEBUG("Readahead of inode %u: %u blocks from %u", inode->i_ino,
+	      size, start);
+	ra_submit(inode, start, size);
+}
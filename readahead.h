@@ -0,0 +1,26 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+struct e4f_file;
+
+/* Upper bound of a readahead window */
+#define RA_MAX_BYTES (2 << 20)
+
+/*
+ * Sequential readahead state of an open file.  Blocks are read ahead
+ * one window at a time: when a read enters the last window, the next
+ * one, twice as large, is submitted behind it.
+ */
+struct file_ra_state {
+	uint32_t ra_start;	/* first block of the last window */
+	uint32_t ra_size;	/* blocks in it, 0 if not sequential */
+	uint32_t ra_prev;	/* block following the last read */
+};
+
+void file_ra_read(struct e4f_file *file, uint32_t lblock, uint32_t nr);
+
+#endif
@@ -120,6 +120,32 @@ uint32_t super_inode_size(void)
     return super_block.s_inode_size;
 }
 
+/* Levels an htree directory index may have, or 0 without dir_index */
+int super_dx_max_levels(void)
+{
+    if (!EXT4_HAS_COMPAT_FEATURE(&super_block, EXT4_FEATURE_COMPAT_DIR_INDEX)) return 0;
+    if (EXT4_HAS_INCOMPAT_FEATURE(&super_block, EXT4_FEATURE_INCOMPAT_LARGEDIR)) return 3;
+    return 2;
+}
+
+/* Copies the seed of the directory hash to seed.  Returns whether names are
+ * hashed as unsigned chars, which is what the DX_HASH_*_UNSIGNED versions,
+ * 3 versions past the signed ones, are about. */
+int super_dx_hash_info(uint32_t seed[4])
+{
+    for (int i = 0; i < 4; i++) {
+        seed[i] = le32_to_cpu(super_block.s_hash_seed[i]);
+    }
+
+    if (super_block.s_flags & cpu_to_le32(EXT2_FLAGS_SIGNED_HASH)) return 0;
+    if (super_block.s_flags & cpu_to_le32(EXT2_FLAGS_UNSIGNED_HASH)) return 1;
+#ifdef __CHAR_UNSIGNED__
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 uint32_t super_inodes_per_block(void)
 {
     return super_block_size() / super_inode_size();
@@ -501,7 +527,9 @@ int ext4_try_to_init_block_bitmap(ext4_group_t block_group)
         struct buffer_head *bh = fs_bwrite(bitmap_blk, &ret);
         if (!bh)
             return ret;
+        set_buffer_meta(bh);
         ext4_init_block_bitmap(bh, block_group);
+        unlock_buffer(bh);
         fs_brelse(bh);
     }
     return 0;
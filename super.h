@@ -25,6 +25,8 @@ int super_block_size_bits(void);
 uint64_t super_blocks_per_group(void);
 uint32_t super_inodes_per_group(void);
 uint32_t super_inode_size(void);
+int super_dx_max_levels(void);
+int super_dx_hash_info(uint32_t seed[4]);
 ext4_fsblk_t super_first_data_block(void);
 ext4_group_t super_n_block_groups(void);
 int super_fill(void);
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Read the same set of files with several concurrent readers.  The reported
+# time can be compared across TEST_PARALLEL_READERS values to see how the
+# read path scales with the number of threads.
+function t0016 {
+    for i in `seq 1 $READERS`
+    do
+        md5sum $MOUNTPOINT/`basename $TMP_FILE`.$(($i % 4)) | cut -d\  -f1 > $TMP_FILE.md5.$i &
+    done
+    wait
+    for i in `seq 1 $READERS`
+    do
+        FUSE_MD5[$i]=`cat $TMP_FILE.md5.$i`
+    done
+}
+
+function t0016-check {
+    for i in `seq 1 $READERS`
+    do
+        [ "${FUSE_MD5[$i]}" = "${FILE_MD5[$(($i % 4))]}" ] || return 1
+    done
+}
+
+set -e
+source `dirname $0`/lib.sh
+
+READERS=${TEST_PARALLEL_READERS:-8}
+
+e4test_make_LOGFILE
+e4test_make_FS 256
+
+# Make a few random files, and store their md5
+TMP_FILE=`mktemp`
+for i in `seq 0 3`
+do
+    dd if=/dev/urandom of=$TMP_FILE.$i bs=1024 count=16384 &> /dev/null
+    FILE_MD5[$i]=`md5sum $TMP_FILE.$i | cut -d\  -f1`
+    e4test_debugfs_write $TMP_FILE.$i
+done
+
+# Check the md5 after mount using fuse
+e4test_make_MOUNTPOINT
+e4test_fuse_mount
+e4test_run t0016
+e4test_fuse_umount
+
+rm $FS
+rm $TMP_FILE $TMP_FILE.*
+
+e4test_end t0016-check
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Read a set of files once each, sequentially.  Blocks that were only read
+# once, even if readahead brought them in first, have to stay on the
+# recently used side of the ARC cache (T1) rather than push out the
+# frequently used ones (T2).
+function t0017 {
+    cat $MOUNTPOINT/`basename $TMP_FILE`.$RUN > /dev/null
+    RUN=$(($RUN + 1))
+}
+
+function t0017-check {
+    [ -n "$T1" ] && [ -n "$T2" ] || return 1
+    # Only metadata is used twice
+    [ "$T1" -ge 10000 ] || return 1
+    [ $(($T2 * 100)) -lt "$T1" ] || return 1
+}
+
+set -e
+source `dirname $0`/lib.sh
+
+e4test_make_LOGFILE
+e4test_make_FS 256
+
+TMP_FILE=`mktemp`
+for i in `seq 0 9`
+do
+    dd if=/dev/urandom of=$TMP_FILE.$i bs=1024 count=8192 &> /dev/null
+    e4test_debugfs_write $TMP_FILE.$i
+done
+
+RUN=0
+e4test_make_MOUNTPOINT
+e4test_fuse_mount
+e4test_run t0017
+e4test_fuse_umount
+
+# The cache statistics are logged once the filesystem is gone
+for i in `seq 1 100`
+do
+    grep -q "arc: p" $LOGFILE && break
+    sleep .1
+done
+T1=`sed -n 's/.*arc: p .*, T1 \([0-9]*\), T2 \([0-9]*\),.*/\1/p' $LOGFILE`
+T2=`sed -n 's/.*arc: p .*, T1 \([0-9]*\), T2 \([0-9]*\),.*/\2/p' $LOGFILE`
+
+rm $FS
+rm $TMP_FILE $TMP_FILE.*
+
+e4test_end t0017-check
@@ -8,23 +8,41 @@
 #ifdef __64BITS
 #define DCACHE_ENTRY_NAME_LEN       40
 #else
-#define DCACHE_ENTRY_NAME_LEN       48
+#define DCACHE_ENTRY_NAME_LEN       44
 #endif
 
 
-/* This struct declares a node of a k-tree.  Every node has a pointer to one of
- * the childs and a pointer (in a circular list fashion) to its siblings. */
+/* This struct declares an entry of the dcache hash table, which maps a name
+ * in the directory with inode number parent to an inode number and the
+ * EXT4_FT_* file type of its directory entry.  Entries falling in the same
+ * hash bucket are chained through next.  Names too long for the entry live
+ * in an allocation of their own, see dcache_entry_name(). */
 
 struct dcache_entry {
-    struct dcache_entry *childs;
-    struct dcache_entry *siblings;
+    struct dcache_entry *next;
+    uint32_t parent;
     uint32_t inode;
+    uint32_t hash;
     uint16_t lru_count;
-    uint8_t user_count;
-    char name[DCACHE_ENTRY_NAME_LEN];
+    uint8_t name_len;
+    uint8_t file_type;
+    union {
+        char name[DCACHE_ENTRY_NAME_LEN];
+        char *long_name;
+    };
 };
 
 /* Keep the struct cacheline friendly */
 STATIC_ASSERT(sizeof(struct dcache_entry) == 64);
 
+static inline int dcache_entry_name_is_long(const struct dcache_entry *entry)
+{
+    return entry->name_len >= DCACHE_ENTRY_NAME_LEN;
+}
+
+static inline const char *dcache_entry_name(const struct dcache_entry *entry)
+{
+    return dcache_entry_name_is_long(entry) ? entry->long_name : entry->name;
+}
+
 #endif
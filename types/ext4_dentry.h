@@ -32,6 +32,16 @@
 
 #define EXT4_NAME_LEN 255
 
+/* Values of file_type, only set with the filetype feature */
+#define EXT4_FT_UNKNOWN     0
+#define EXT4_FT_REG_FILE    1
+#define EXT4_FT_DIR         2
+#define EXT4_FT_CHRDEV      3
+#define EXT4_FT_BLKDEV      4
+#define EXT4_FT_FIFO        5
+#define EXT4_FT_SOCK        6
+#define EXT4_FT_SYMLINK     7
+
 struct ext4_dir_entry_2 {
     __le32  inode;          /* Inode number */
     __le16  rec_len;        /* Directory entry length */
@@ -40,4 +50,58 @@ struct ext4_dir_entry_2 {
     char    name[EXT4_NAME_LEN];    /* File name */
 };
 
+/* Room an entry with a name of __len bytes takes, header included */
+#define EXT4_DIR_REC_LEN(__len)     (((__len) + 8 + 3) & ~3)
+
+/* Hash versions of htree (dir_index) directories */
+#define DX_HASH_LEGACY              0
+#define DX_HASH_HALF_MD4            1
+#define DX_HASH_TEA                 2
+#define DX_HASH_LEGACY_UNSIGNED     3
+#define DX_HASH_HALF_MD4_UNSIGNED   4
+#define DX_HASH_TEA_UNSIGNED        5
+
+/* The first dx_entry of a node holds its count and limit instead */
+struct dx_countlimit {
+    __le16  limit;
+    __le16  count;
+};
+
+struct dx_entry {
+    __le32  hash;
+    __le32  block;          /* Directory lblock, low 28 bits */
+};
+
+/* Directory entry header, as index blocks disguise themselves as empty
+ * directory blocks */
+struct fake_dirent {
+    __le32  inode;
+    __le16  rec_len;
+    __u8    name_len;
+    __u8    file_type;
+};
+
+/* Block 0 of an htree directory, seen as "." and ".." by everyone else */
+struct dx_root_info {
+    __le32  reserved_zero;
+    __u8    hash_version;
+    __u8    info_length;    /* 8 */
+    __u8    indirect_levels;
+    __u8    unused_flags;
+};
+
+struct dx_root {
+    struct fake_dirent dot;
+    char    dot_name[4];
+    struct fake_dirent dotdot;
+    char    dotdot_name[4];
+    struct dx_root_info info;
+    /* dx_entry array follows, info_length bytes after info */
+};
+
+struct dx_node {
+    struct fake_dirent fake;
+    struct dx_entry entries[];
+};
+
 #endif
@@ -87,6 +87,10 @@
 #define EXT4_FEATURE_INCOMPAT_LARGEDIR		0x4000 /* >2GB or 3-lvl htree */
 #define EXT4_FEATURE_INCOMPAT_INLINEDATA	0x8000 /* data in inode */
 
+/* Bits of s_flags */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001  /* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002  /* Unsigned dirhash in use */
+
 #define EXT4_FEATURE_INCOMPAT_SUPP	(                       \
                     EXT4_FEATURE_INCOMPAT_FILETYPE|         \
 					EXT4_FEATURE_INCOMPAT_RECOVER|          \
@@ -5,6 +5,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef container_of
+#define container_of(ptr, type, member)                                        \
+	((type *)((char *)(ptr) - (unsigned long)(&((type *)0)->member)))
+#endif
+
 struct list_head
 {
 	struct list_head *prev;
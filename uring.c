@@ -0,0 +1,261 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licens
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-
+ */
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+
+	ring->ur_fd = io_uring_setup(entries, &p);
+	if (ring->ur_fd < 0)
+		return -errno;
+
+	ring->ur_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->ur_cq_size = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ur_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->ur_sq_ptr = mmap(NULL, ring->ur_sq_size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, ring->ur_fd,
+			       IORING_OFF_SQ_RING);
+	if (ring->ur_sq_ptr == MAP_FAILED)
+		goto err;
+
+	ring->ur_cq_ptr = mmap(NULL, ring->ur_cq_size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, ring->ur_fd,
+			       IORING_OFF_CQ_RING);
+	if (ring->ur_cq_ptr == MAP_FAILED)
+		goto err_sq;
+
+	ring->ur_sqes = mmap(NULL, ring->ur_sqes_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->ur_fd,
+			     IORING_OFF_SQES);
+	if (ring->ur_sqes == MAP_FAILED)
+		goto err_cq;
+
+	sq = ring->ur_sq_ptr;
+	ring->ur_sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->ur_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->ur_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->ur_sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->ur_sq_entries = p.sq_entries;
+
+	cq = ring->ur_cq_ptr;
+	ring->ur_cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->ur_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->ur_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->ur_cqes = cq + p.cq_off.cqes;
+
+	pthread_mutex_init(&ring->ur_sq_lock, NULL);
+	return 0;
+
+err_cq:
+	munmap(ring->ur_cq_ptr, ring->ur_cq_size);
+err_sq:
+	munmap(ring->ur_sq_ptr, ring->ur_sq_size);
+err:
+	close(ring->ur_fd);
+	ring->ur_fd = -1;
+	return -ENOMEM;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->ur_fd < 0)
+		return;
+
+	munmap(ring->ur_sqes, ring->ur_sqes_size);
+	munmap(ring->ur_cq_ptr, ring->ur_cq_size);
+	munmap(ring->ur_sq_ptr, ring->ur_sq_size);
+	close(ring->ur_fd);
+	ring->ur_fd = -1;
+	pthread_mutex_destroy(&ring->ur_sq_lock);
+}
+
+/*
+ * Hand the queued SQEs to the kernel.  Called with ur_sq_lock held.
+ */
+static int __uring_submit(struct uring *ring)
+{
+	while (ring->ur_sq_pending) {
+		int ret = io_uring_enter(ring->ur_fd, ring->ur_sq_pending, 0, 0);
+		if (ret < 0) {
+			/* EBUSY: the completion queue is full, let the
+			 * reaper catch up. */
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				sched_yield();
+				continue;
+			}
+			return -errno;
+		}
+		ring->ur_sq_pending -= ret;
+	}
+	return 0;
+}
+
+int uring_submit(struct uring *ring)
+{
+	int ret;
+
+	pthread_mutex_lock(&ring->ur_sq_lock);
+	ret = __uring_submit(ring);
+	pthread_mutex_unlock(&ring->ur_sq_lock);
+	return ret;
+}
+
+/*
+ * Grab a free SQE, submitting what is queued if the ring is full.
+ * Called with ur_sq_lock held.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned tail = *ring->ur_sq_tail;
+	struct io_uring_sqe *sqe;
+
+	while (tail - __atomic_load_n(ring->ur_sq_head, __ATOMIC_ACQUIRE) >=
+	       ring->ur_sq_entries) {
+		if (__uring_submit(ring) < 0)
+			return NULL;
+		sched_yield();
+	}
+
+	sqe = (struct io_uring_sqe *)ring->ur_sqes + (tail & *ring->ur_sq_mask);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/*
+ * Publish @sqe to the kernel and flush the queue once a batch has been
+ * collected.  Called with ur_sq_lock held.
+ */
+static int uring_commit_sqe(struct uring *ring, struct io_uring_sqe *sqe)
+{
+	unsigned tail = *ring->ur_sq_tail;
+
+	ring->ur_sq_array[tail & *ring->ur_sq_mask] =
+		sqe - (struct io_uring_sqe *)ring->ur_sqes;
+	__atomic_store_n(ring->ur_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->ur_sq_pending++;
+
+	if (ring->ur_sq_pending >= URING_SUBMIT_BATCH)
+		return __uring_submit(ring);
+	return 0;
+}
+
+/*
+ * Queue a read or write of @len bytes at @offset.  The request is not
+ * necessarily handed to the kernel until uring_submit() is called.
+ */
+int uring_queue_rw(struct uring *ring, int is_write, int fd, void *buf,
+		   size_t len, off_t offset, void *data)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	pthread_mutex_lock(&ring->ur_sq_lock);
+	sqe = uring_get_sqe(ring);
+	if (!sqe) {
+		pthread_mutex_unlock(&ring->ur_sq_lock);
+		return -EIO;
+	}
+
+	sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)data;
+
+	ret = uring_commit_sqe(ring, sqe);
+	pthread_mutex_unlock(&ring->ur_sq_lock);
+	return ret;
+}
+
+int uring_queue_nop(struct uring *ring, void *data)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	pthread_mutex_lock(&ring->ur_sq_lock);
+	sqe = uring_get_sqe(ring);
+	if (!sqe) {
+		pthread_mutex_unlock(&ring->ur_sq_lock);
+		return -EIO;
+	}
+
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = (uintptr_t)data;
+
+	ret = uring_commit_sqe(ring, sqe);
+	pthread_mutex_unlock(&ring->ur_sq_lock);
+	return ret;
+}
+
+/*
+ * Wait for at least one completion and call @complete for everything
+ * found in the completion queue.  Only one thread may reap a ring.
+ */
+int uring_reap(struct uring *ring, uring_complete_t *complete)
+{
+	unsigned head, tail;
+	int nr = 0;
+
+	if (io_uring_enter(ring->ur_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+	    errno != EINTR)
+		return -errno;
+
+	head = *ring->ur_cq_head;
+	tail = __atomic_load_n(ring->ur_cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = (struct io_uring_cqe *)ring->ur_cqes +
+					   (head & *ring->ur_cq_mask);
+		void *data = (void *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+
+		/* Give the slot back before running the completion */
+		__atomic_store_n(ring->ur_cq_head, ++head, __ATOMIC_RELEASE);
+		complete(data, res);
+		nr++;
+	}
+
+	return nr;
+}
@@ -0,0 +1,56 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * A minimal io_uring wrapper talking to the kernel through the raw
+ * syscalls, so that no liburing is needed.  Submissions may come from
+ * any thread and are serialized by ur_sq_lock, while completions are
+ * reaped by a single thread.
+ *
+ * <linux/io_uring.h> is only included by uring.c, as its __u64 and
+ * friends clash with the macros of types/ext4_basic.h.
+ */
+struct uring {
+	int ur_fd;
+
+	/* Submission queue */
+	pthread_mutex_t ur_sq_lock;
+	unsigned *ur_sq_head;
+	unsigned *ur_sq_tail;
+	unsigned *ur_sq_mask;
+	unsigned *ur_sq_array;
+	unsigned ur_sq_entries;
+	unsigned ur_sq_pending; /* queued, but not handed to the kernel */
+	void *ur_sqes;          /* struct io_uring_sqe[] */
+
+	/* Completion queue */
+	unsigned *ur_cq_head;
+	unsigned *ur_cq_tail;
+	unsigned *ur_cq_mask;
+	void *ur_cqes;          /* struct io_uring_cqe[] */
+
+	void *ur_sq_ptr;
+	size_t ur_sq_size;
+	void *ur_cq_ptr;
+	size_t ur_cq_size;
+	size_t ur_sqes_size;
+};
+
+/* SQEs queued before they are handed to the kernel in one go */
+#define URING_SUBMIT_BATCH 16
+
+typedef void (uring_complete_t)(void *data, int res);
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+int uring_queue_rw(struct uring *ring, int is_write, int fd, void *buf,
+		   size_t len, off_t offset, void *data);
+int uring_queue_nop(struct uring *ring, void *data);
+int uring_submit(struct uring *ring);
+int uring_reap(struct uring *ring, uring_complete_t *complete);
+
+#endif